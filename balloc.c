@@ -17,6 +17,8 @@
 #include <linux/sched.h>
 #include <linux/buffer_head.h>
 #include <linux/capability.h>
+#include <linux/blkdev.h>
+#include <linux/crc16.h>
 
 /*
  * balloc.c contains the blocks allocation and deallocation routines
@@ -70,39 +72,165 @@ struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 	return desc + offset;
 }
 
+/*
+ * ext3301: uninit_bg descriptor checksums, computed the way e2fsprogs
+ * and ext4 do.
+ */
+__le16 ext2_group_desc_csum(struct super_block *sb, unsigned int group,
+			    struct ext2_group_desc *desc)
+{
+	__le32 le_group = cpu_to_le32(group);
+	u16 crc;
+
+	crc = crc16(~0, EXT2_SB(sb)->s_es->s_uuid,
+		    sizeof(EXT2_SB(sb)->s_es->s_uuid));
+	crc = crc16(crc, (u8 *)&le_group, sizeof(le_group));
+	crc = crc16(crc, (u8 *)desc,
+		    offsetof(struct ext2_group_desc, bg_checksum));
+	return cpu_to_le16(crc);
+}
+
+/* Call with the group lock held, after changing @desc */
+void ext2_group_desc_csum_set(struct super_block *sb, unsigned int group,
+			      struct ext2_group_desc *desc)
+{
+	if (ext2_has_group_desc_csum(sb))
+		desc->bg_checksum = ext2_group_desc_csum(sb, group, desc);
+}
+
+/*
+ * ext3301: build the block bitmap of a BLOCK_UNINIT group, which isn't
+ * on disk yet.  Only the group's own metadata is in use: the superblock
+ * and descriptor backups, the bitmaps and the inode table.  Bits past the
+ * end of the group are set, as mke2fs does.  With FLEX_BG the bitmaps and
+ * table may live in another group; mke2fs never leaves a group that holds
+ * other groups' metadata BLOCK_UNINIT, so those need no bits here.
+ */
+static void ext2_init_block_bitmap(struct super_block *sb, unsigned int group,
+				   struct ext2_group_desc *desc,
+				   struct buffer_head *bh)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_super_block *es = sbi->s_es;
+	ext2_fsblk_t first = ext2_group_first_block_no(sb, group);
+	unsigned long len = EXT2_BLOCKS_PER_GROUP(sb);
+	unsigned long meta = 0, dpb = EXT2_DESC_PER_BLOCK(sb), i;
+
+	if (group == sbi->s_groups_count - 1)
+		len = le32_to_cpu(es->s_blocks_count) - first;
+
+	if (!EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_META_BG) ||
+	    group < le32_to_cpu(es->s_first_meta_bg) * dpb) {
+		if (ext2_bg_has_super(sb, group))
+			meta = 1 + ext2_bg_num_gdb(sb, group) +
+				le16_to_cpu(es->s_reserved_gdt_blocks);
+	} else {
+		meta = ext2_bg_has_super(sb, group);
+		i = group % dpb;
+		if (i == 0 || i == 1 || i == dpb - 1)
+			meta++;
+	}
+
+	memset(bh->b_data, 0, sb->s_blocksize);
+	for (i = 0; i < meta; i++)
+		ext2_set_bit(i, bh->b_data);
+	if (ext2_block_in_group(sb, le32_to_cpu(desc->bg_block_bitmap), group))
+		ext2_set_bit(le32_to_cpu(desc->bg_block_bitmap) - first,
+			     bh->b_data);
+	if (ext2_block_in_group(sb, le32_to_cpu(desc->bg_inode_bitmap), group))
+		ext2_set_bit(le32_to_cpu(desc->bg_inode_bitmap) - first,
+			     bh->b_data);
+	for (i = 0; i < sbi->s_itb_per_group; i++) {
+		ext2_fsblk_t blk = le32_to_cpu(desc->bg_inode_table) + i;
+
+		if (ext2_block_in_group(sb, blk, group))
+			ext2_set_bit(blk - first, bh->b_data);
+	}
+	for (i = len; i < sb->s_blocksize * 8; i++)
+		ext2_set_bit(i, bh->b_data);
+}
+
+/*
+ * ext3301: do blocks [block, block + count) overlap the bitmaps or inode
+ * table of @group, or with FLEX_BG of any group in its flex group?
+ */
+static int ext2_in_system_zone(struct super_block *sb, unsigned int group,
+			       ext2_fsblk_t block, unsigned long count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned int first = group, last = group;
+	struct ext2_group_desc *desc;
+
+	if (sbi->s_log_groups_per_flex) {
+		first = group >> sbi->s_log_groups_per_flex
+				<< sbi->s_log_groups_per_flex;
+		last = min_t(unsigned int, sbi->s_groups_count - 1,
+			     first + (1U << sbi->s_log_groups_per_flex) - 1);
+	}
+	for (group = first; group <= last; group++) {
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (!desc)
+			continue;
+		if (in_range(le32_to_cpu(desc->bg_block_bitmap), block, count) ||
+		    in_range(le32_to_cpu(desc->bg_inode_bitmap), block, count) ||
+		    in_range(block, le32_to_cpu(desc->bg_inode_table),
+			     sbi->s_itb_per_group) ||
+		    in_range(block + count - 1, le32_to_cpu(desc->bg_inode_table),
+			     sbi->s_itb_per_group))
+			return 1;
+	}
+	return 0;
+}
+
 static int ext2_valid_block_bitmap(struct super_block *sb,
 					struct ext2_group_desc *desc,
 					unsigned int block_group,
 					struct buffer_head *bh)
 {
-	ext2_grpblk_t offset;
+	ext2_grpblk_t offset, end;
 	ext2_grpblk_t next_zero_bit;
-	ext2_fsblk_t bitmap_blk;
+	ext2_fsblk_t bitmap_blk, table_end;
 	ext2_fsblk_t group_first_block;
 
 	group_first_block = ext2_group_first_block_no(sb, block_group);
 
+	/*
+	 * ext3301: with FLEX_BG any of these may sit in another group,
+	 * whose bitmap is the one to check them against.  Only what lies
+	 * in this group is checked here.
+	 */
+
 	/* check whether block bitmap block number is set */
 	bitmap_blk = le32_to_cpu(desc->bg_block_bitmap);
 	offset = bitmap_blk - group_first_block;
-	if (!ext2_test_bit(offset, bh->b_data))
+	if (ext2_block_in_group(sb, bitmap_blk, block_group) &&
+	    !ext2_test_bit(offset, bh->b_data))
 		/* bad block bitmap */
 		goto err_out;
 
 	/* check whether the inode bitmap block number is set */
 	bitmap_blk = le32_to_cpu(desc->bg_inode_bitmap);
 	offset = bitmap_blk - group_first_block;
-	if (!ext2_test_bit(offset, bh->b_data))
+	if (ext2_block_in_group(sb, bitmap_blk, block_group) &&
+	    !ext2_test_bit(offset, bh->b_data))
 		/* bad block bitmap */
 		goto err_out;
 
 	/* check whether the inode table block number is set */
 	bitmap_blk = le32_to_cpu(desc->bg_inode_table);
+	if (bitmap_blk < group_first_block)
+		bitmap_blk = group_first_block;
+	table_end = le32_to_cpu(desc->bg_inode_table) +
+			EXT2_SB(sb)->s_itb_per_group;
+	if (table_end > group_first_block + EXT2_BLOCKS_PER_GROUP(sb))
+		table_end = group_first_block + EXT2_BLOCKS_PER_GROUP(sb);
+	if (bitmap_blk >= table_end)
+		/* the whole table is elsewhere */
+		return 1;
 	offset = bitmap_blk - group_first_block;
-	next_zero_bit = ext2_find_next_zero_bit(bh->b_data,
-				offset + EXT2_SB(sb)->s_itb_per_group,
-				offset);
-	if (next_zero_bit >= offset + EXT2_SB(sb)->s_itb_per_group)
+	end = table_end - group_first_block;
+	next_zero_bit = ext2_find_next_zero_bit(bh->b_data, end, offset);
+	if (next_zero_bit >= end)
 		/* good bitmap for inode tables */
 		return 1;
 
@@ -120,13 +248,17 @@ err_out:
  *
  * Return buffer_head on success or NULL in case of failure.
  */
-static struct buffer_head *
-read_block_bitmap(struct super_block *sb, unsigned int block_group)
+struct buffer_head *
+ext2_read_block_bitmap(struct super_block *sb, unsigned int block_group)
 {
 	struct ext2_group_desc * desc;
 	struct buffer_head * bh = NULL;
 	ext2_fsblk_t bitmap_blk;
 
+	bh = ext2_bitmap_cache_get(sb, block_group);
+	if (bh)
+		return bh;
+
 	desc = ext2_get_group_desc(sb, block_group, NULL);
 	if (!desc)
 		return NULL;
@@ -139,10 +271,22 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 			    block_group, le32_to_cpu(desc->bg_block_bitmap));
 		return NULL;
 	}
-	if (likely(bh_uptodate_or_lock(bh)))
-		return bh;
-
-	if (bh_submit_read(bh) < 0) {
+	/*
+	 * ext3301: nothing on disk to read for an uninit group.  Whatever
+	 * is there is garbage, so an uptodate buffer only means something
+	 * if we built it.
+	 */
+	if (ext2_bg_flags(sb, desc) & EXT2_BG_BLOCK_UNINIT) {
+		lock_buffer(bh);
+		if (!buffer_bitmap_init(bh)) {
+			ext2_init_block_bitmap(sb, block_group, desc, bh);
+			set_buffer_bitmap_init(bh);
+			set_buffer_uptodate(bh);
+			clear_buffer_bitmap_checked(bh);
+		}
+		unlock_buffer(bh);
+	}
+	if (unlikely(!bh_uptodate_or_lock(bh)) && bh_submit_read(bh) < 0) {
 		brelse(bh);
 		ext2_error(sb, __func__,
 			    "Cannot read block bitmap - "
@@ -151,7 +295,15 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 		return NULL;
 	}
 
-	ext2_valid_block_bitmap(sb, desc, block_group, bh);
+	/*
+	 * ext3301: validate once per load, whoever read the block in (it
+	 * may have been ext2_bitmap_prefetch()).
+	 */
+	if (!buffer_bitmap_checked(bh)) {
+		ext2_valid_block_bitmap(sb, desc, block_group, bh);
+		set_buffer_bitmap_checked(bh);
+	}
+	ext2_bitmap_cache_add(sb, block_group, bh);
 	/*
 	 * file system mounted not to panic on error, continue with corrupt
 	 * bitmap
@@ -169,7 +321,11 @@ static void group_adjust_blocks(struct super_block *sb, int group_no,
 		spin_lock(sb_bgl_lock(sbi, group_no));
 		free_blocks = le16_to_cpu(desc->bg_free_blocks_count);
 		desc->bg_free_blocks_count = cpu_to_le16(free_blocks + count);
+		/* ext3301: the bitmap is about to be written out for real */
+		desc->bg_flags &= cpu_to_le16(~EXT2_BG_BLOCK_UNINIT);
+		ext2_group_desc_csum_set(sb, group_no, desc);
 		spin_unlock(sb_bgl_lock(sbi, group_no));
+		ext2_group_sum_update(sb, group_no);
 		mark_buffer_dirty(bh);
 	}
 }
@@ -180,11 +336,37 @@ static void group_adjust_blocks(struct super_block *sb, int group_no,
  * Operations include:
  * dump, find, add, remove, is_empty, find_next_reservable_window, etc.
  *
- * We use a red-black tree to represent per-filesystem reservation
- * windows.
+ * We use a red-black tree to represent the reservation windows.
  *
+ * ext3301: there is one tree per shard of block groups rather than one
+ * per filesystem, so writers allocating in different parts of the disk
+ * don't all queue on the same spinlock.  Windows are clamped to the end
+ * of their shard.  A window is only ever moved by its owner (under the
+ * inode's truncate_mutex), so the owner may look at its own window
+ * without a lock; everybody else's windows are only walked under the
+ * shard's rs_lock.
  */
 
+static struct ext2_rsv_shard *rsv_group_shard(struct super_block *sb,
+					      unsigned int group)
+{
+	return &EXT2_SB(sb)->s_rsv_shards[group >> EXT2_SB(sb)->s_rsv_shard_bits];
+}
+
+/* The shard whose tree holds a window starting at @block */
+static struct ext2_rsv_shard *rsv_block_shard(struct super_block *sb,
+					      ext2_fsblk_t block)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long group;
+
+	group = (block - le32_to_cpu(sbi->s_es->s_first_data_block)) /
+		EXT2_BLOCKS_PER_GROUP(sb);
+	if (group >= sbi->s_groups_count)
+		group = sbi->s_groups_count - 1;
+	return rsv_group_shard(sb, group);
+}
+
 /**
  * __rsv_window_dump() -- Dump the filesystem block allocation reservation map
  * @rb_root:		root of per-filesystem reservation rb tree
@@ -321,15 +503,15 @@ search_reserve_window(struct rb_root *root, ext2_fsblk_t goal)
 
 /*
  * ext2_rsv_window_add() -- Insert a window to the block reservation rb tree.
- * @sb:			super block
+ * @shard:		shard the window starts in
  * @rsv:		reservation window to add
  *
- * Must be called with rsv_lock held.
+ * Must be called with the shard's rs_lock held.
  */
-void ext2_rsv_window_add(struct super_block *sb,
+static void ext2_rsv_window_add(struct ext2_rsv_shard *shard,
 		    struct ext2_reserve_window_node *rsv)
 {
-	struct rb_root *root = &EXT2_SB(sb)->s_rsv_window_root;
+	struct rb_root *root = &shard->rs_root;
 	struct rb_node *node = &rsv->rsv_node;
 	ext2_fsblk_t start = rsv->rsv_start;
 
@@ -358,20 +540,21 @@ void ext2_rsv_window_add(struct super_block *sb,
 
 /**
  * rsv_window_remove() -- unlink a window from the reservation rb tree
- * @sb:			super block
+ * @shard:		shard holding the window
  * @rsv:		reservation window to remove
  *
  * Mark the block reservation window as not allocated, and unlink it
- * from the filesystem reservation window rb tree. Must be called with
- * rsv_lock held.
+ * from the shard's reservation window rb tree. Must be called with
+ * the shard's rs_lock held.
  */
-static void rsv_window_remove(struct super_block *sb,
+static void rsv_window_remove(struct ext2_rsv_shard *shard,
 			      struct ext2_reserve_window_node *rsv)
 {
 	rsv->rsv_start = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_end = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_alloc_hit = 0;
-	rb_erase(&rsv->rsv_node, &EXT2_SB(sb)->s_rsv_window_root);
+	rb_erase(&rsv->rsv_node, &shard->rs_root);
+	shard->rs_windows--;
 }
 
 /*
@@ -386,6 +569,67 @@ static inline int rsv_is_empty(struct ext2_reserve_window *rsv)
 	return (rsv->_rsv_end == EXT2_RESERVE_WINDOW_NOT_ALLOCATED);
 }
 
+/**
+ * ext2_rsv_init()
+ * @sb:			super block
+ *
+ * Set up the reservation window trees: one per block group, or per run
+ * of groups on filesystems with more than EXT2_RSV_MAX_SHARDS groups.
+ */
+int ext2_rsv_init(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long groups = sbi->s_groups_count;
+	unsigned long nr, i;
+	unsigned int bits = 0;
+
+	while (((groups - 1) >> bits) + 1 > EXT2_RSV_MAX_SHARDS)
+		bits++;
+	nr = ((groups - 1) >> bits) + 1;
+
+	sbi->s_rsv_shards = kcalloc(nr, sizeof(*sbi->s_rsv_shards),
+				    GFP_KERNEL);
+	if (!sbi->s_rsv_shards)
+		return -ENOMEM;
+	sbi->s_rsv_shard_bits = bits;
+
+	sbi->s_group_streams = kcalloc(groups, sizeof(atomic_t), GFP_KERNEL);
+	if (!sbi->s_group_streams) {
+		kfree(sbi->s_rsv_shards);
+		sbi->s_rsv_shards = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct ext2_rsv_shard *shard = &sbi->s_rsv_shards[i];
+
+		spin_lock_init(&shard->rs_lock);
+		shard->rs_root = RB_ROOT;
+		shard->rs_last_block = ext2_group_first_block_no(sb,
+						(i + 1) << bits) - 1;
+		/*
+		 * Add a single, static dummy reservation to the start of
+		 * each tree --- it gives us a placeholder for
+		 * append-at-start-of-list which makes the allocation logic
+		 * _much_ simpler.
+		 */
+		shard->rs_head.rsv_start = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
+		shard->rs_head.rsv_end = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
+		shard->rs_head.rsv_alloc_hit = 0;
+		shard->rs_head.rsv_goal_size = 0;
+		ext2_rsv_window_add(shard, &shard->rs_head);
+	}
+	return 0;
+}
+
+void ext2_rsv_release(struct super_block *sb)
+{
+	kfree(EXT2_SB(sb)->s_group_streams);
+	EXT2_SB(sb)->s_group_streams = NULL;
+	kfree(EXT2_SB(sb)->s_rsv_shards);
+	EXT2_SB(sb)->s_rsv_shards = NULL;
+}
+
 /**
  * ext2_init_block_alloc_info()
  * @inode:		file inode structure
@@ -432,10 +676,223 @@ void ext2_init_block_alloc_info(struct inode *inode)
 		rsv->rsv_alloc_hit = 0;
 		block_i->last_alloc_logical_block = 0;
 		block_i->last_alloc_physical_block = 0;
+		block_i->seq_alloc_blocks = 0;
+		block_i->rsv_flags = 0;
+		block_i->stream_group = 0;
+		block_i->stream_goal = 0;
 	}
 	ei->i_block_alloc_info = block_i;
 }
 
+/**
+ * ext2_dir_rsv_goal()
+ * @dir:		directory inode
+ *
+ * ext3301: pick the reservation window size for a growing directory.
+ * With the DIR_PREALLOC feature, s_prealloc_dir_blocks says how many
+ * blocks to set aside at a time.  Otherwise the window grows with the
+ * directory, a quarter of its current size, so large directories end up
+ * in long contiguous runs and a cold readdir doesn't seek per block.
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+void ext2_dir_rsv_goal(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ext2_reserve_window_node *rsv =
+		&EXT2_I(dir)->i_block_alloc_info->rsv_window_node;
+	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
+	unsigned long size;
+
+	if (!test_opt(sb, RESERVATION))
+		return;
+	if (EXT2_HAS_COMPAT_FEATURE(sb, EXT2_FEATURE_COMPAT_DIR_PREALLOC) &&
+	    es->s_prealloc_dir_blocks) {
+		size = es->s_prealloc_dir_blocks;
+	} else {
+		size = (dir->i_size >> sb->s_blocksize_bits) / 4;
+		size = clamp_t(unsigned long, size,
+			       EXT2_DEFAULT_RESERVE_BLOCKS,
+			       EXT2_MAX_DIR_RESERVE_BLOCKS);
+	}
+	rsv->rsv_goal_size = size;
+}
+
+/**
+ * ext2_rsv_tune()
+ * @inode:		regular file inode
+ * @block:		first logical block just allocated
+ * @count:		number of blocks just allocated
+ *
+ * ext3301: size the reservation window from the way the file is being
+ * written, before last_alloc_logical_block moves on.  While the file is
+ * appended to in order, the window grows to half the blocks written so
+ * far (up to EXT2_MAX_RESERVE_BLOCKS), so a long streaming write takes
+ * its space in big contiguous pieces.  Each seek halves it again, down to
+ * EXT2_DEFAULT_RESERVE_BLOCKS, so randomly written files don't hold on to
+ * space they won't use.  A window size set through EXT2_IOC_SETRSVSZ is
+ * left alone, as is a file with reservation turned off; the run length
+ * is still counted for them, for ext2_stream_track().
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+void ext2_rsv_tune(struct inode *inode, unsigned long block,
+		   unsigned long count)
+{
+	struct ext2_block_alloc_info *block_i = EXT2_I(inode)->i_block_alloc_info;
+	struct ext2_reserve_window_node *rsv = &block_i->rsv_window_node;
+	unsigned long size = rsv->rsv_goal_size;
+	int seq;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	seq = !block_i->last_alloc_physical_block ||
+	      block == block_i->last_alloc_logical_block + 1;
+	if (!seq)
+		block_i->seq_alloc_blocks = count;
+	else if (block_i->seq_alloc_blocks < EXT2_MAX_RESERVE_BLOCKS * 2)
+		block_i->seq_alloc_blocks += count;
+
+	if (!size || (block_i->rsv_flags & EXT2_RSV_FIXED))
+		return;
+	if (seq)
+		size = max(size, (unsigned long)block_i->seq_alloc_blocks / 2);
+	else
+		size /= 2;
+	rsv->rsv_goal_size = clamp_t(unsigned long, size,
+				     EXT2_DEFAULT_RESERVE_BLOCKS,
+				     EXT2_MAX_RESERVE_BLOCKS);
+}
+
+/*
+ * ext3301: streaming writers.
+ *
+ * Files appended to at the same time in one directory all start out
+ * with goals in the parent's group, so their windows end up side by side
+ * and each file turns into a comb of short runs.  Once a file has
+ * written EXT2_STREAM_BLOCKS in order it counts as a stream of the group
+ * it is allocating in, and if that group already has a stream the file
+ * is sent elsewhere: to a group at least half free with no stream, to
+ * the group with the most free blocks if it has fewer streams, or
+ * failing that to its own slot, EXT2_STREAM_SLOTS of which are spaced
+ * evenly through each group.  The count follows the
+ * stream as it fills one group and moves on to the next, and is dropped
+ * when the file seeks or its reservation is discarded.
+ */
+static unsigned int ext2_block_group_no(struct super_block *sb,
+					ext2_fsblk_t block)
+{
+	return (block - le32_to_cpu(EXT2_SB(sb)->s_es->s_first_data_block)) /
+		EXT2_BLOCKS_PER_GROUP(sb);
+}
+
+/*
+ * Where should a new stream in @group go?  Returns 0 if the group has
+ * no other stream and it can stay where it is.
+ *
+ * Candidates come from the group summary tree (groups.c), so groups
+ * without the room are skipped without looking at their descriptors.
+ * Like any ext2_group_search() user we only see groups that still have
+ * a free inode.
+ */
+static ext2_fsblk_t ext2_stream_goal(struct super_block *sb,
+				     unsigned int group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long ngroups = sbi->s_groups_count;
+	int streams = atomic_read(&sbi->s_group_streams[group]) - 1;
+	struct ext2_group_query q = {
+		.min_free_inodes = 1,
+		.min_free_blocks = EXT2_BLOCKS_PER_GROUP(sb) / 2,
+		.max_dirs = INT_MAX,
+		.max_debt = INT_MAX,
+	};
+	unsigned int next = (group + 1) % ngroups;
+	int best_streams, g, i;
+
+	if (streams <= 0)
+		return 0;
+
+	for (i = 0; i < EXT2_STREAM_PROBES; i++) {
+		g = ext2_group_search(sb, next, &q, 0);
+		if (g < 0 || g == group)
+			break;
+		if (!atomic_read(&sbi->s_group_streams[g])) {
+			best_streams = 0;
+			goto found;
+		}
+		next = (g + 1) % ngroups;
+	}
+
+	q.min_free_blocks = EXT2_MAX_RESERVE_BLOCKS;
+	g = ext2_group_search(sb, (group + 1) % ngroups, &q,
+			      EXT2_GQ_MOST_FREE_BLOCKS);
+	if (g >= 0 && g != group) {
+		best_streams = atomic_read(&sbi->s_group_streams[g]);
+		if (best_streams < streams)
+			goto found;
+	}
+	return ext2_group_first_block_no(sb, group) +
+		(streams % EXT2_STREAM_SLOTS) *
+		(EXT2_BLOCKS_PER_GROUP(sb) / EXT2_STREAM_SLOTS);
+
+found:
+	return ext2_group_first_block_no(sb, g) +
+		(best_streams % EXT2_STREAM_SLOTS) *
+		(EXT2_BLOCKS_PER_GROUP(sb) / EXT2_STREAM_SLOTS);
+}
+
+static void ext2_stream_stop(struct inode *inode)
+{
+	struct ext2_block_alloc_info *block_i = EXT2_I(inode)->i_block_alloc_info;
+
+	if (!(block_i->rsv_flags & EXT2_RSV_STREAM))
+		return;
+	atomic_dec(&EXT2_SB(inode->i_sb)->s_group_streams[block_i->stream_group]);
+	block_i->rsv_flags &= ~EXT2_RSV_STREAM;
+	block_i->stream_goal = 0;
+}
+
+/**
+ * ext2_stream_track()
+ * @inode:		regular file inode
+ *
+ * ext3301: called after each allocation, once last_alloc_physical_block
+ * is up to date, to keep the file's stream accounting straight and pick
+ * a new goal for it when it turns into a stream.
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+void ext2_stream_track(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_block_alloc_info *block_i = EXT2_I(inode)->i_block_alloc_info;
+	unsigned int group;
+
+	if (!sbi->s_group_streams || !S_ISREG(inode->i_mode))
+		return;
+	if (block_i->seq_alloc_blocks < EXT2_STREAM_BLOCKS) {
+		ext2_stream_stop(inode);
+		return;
+	}
+
+	group = ext2_block_group_no(sb, block_i->last_alloc_physical_block);
+	if (block_i->rsv_flags & EXT2_RSV_STREAM) {
+		if (group != block_i->stream_group) {
+			atomic_dec(&sbi->s_group_streams[block_i->stream_group]);
+			atomic_inc(&sbi->s_group_streams[group]);
+			block_i->stream_group = group;
+		}
+		return;
+	}
+	atomic_inc(&sbi->s_group_streams[group]);
+	block_i->stream_group = group;
+	block_i->rsv_flags |= EXT2_RSV_STREAM;
+	block_i->stream_goal = ext2_stream_goal(sb, group);
+}
+
 /**
  * ext2_discard_reservation()
  * @inode:		inode
@@ -453,18 +910,243 @@ void ext2_discard_reservation(struct inode *inode)
 	struct ext2_inode_info *ei = EXT2_I(inode);
 	struct ext2_block_alloc_info *block_i = ei->i_block_alloc_info;
 	struct ext2_reserve_window_node *rsv;
-	spinlock_t *rsv_lock = &EXT2_SB(inode->i_sb)->s_rsv_window_lock;
+	struct ext2_rsv_shard *shard;
 
 	if (!block_i)
 		return;
 
+	ext2_stream_stop(inode);
 	rsv = &block_i->rsv_window_node;
 	if (!rsv_is_empty(&rsv->rsv_window)) {
-		spin_lock(rsv_lock);
+		shard = rsv_block_shard(inode->i_sb, rsv->rsv_start);
+		spin_lock(&shard->rs_lock);
 		if (!rsv_is_empty(&rsv->rsv_window))
-			rsv_window_remove(inode->i_sb, rsv);
-		spin_unlock(rsv_lock);
+			rsv_window_remove(shard, rsv);
+		spin_unlock(&shard->rs_lock);
+	}
+}
+
+/*
+ * ext3301: discard support.
+ *
+ * Free space is trimmed the way blocks are allocated.  Each free run is
+ * first claimed in the bitmap with ext2_set_bit_atomic(), so nobody can
+ * allocate those blocks and write to them while the discard is in
+ * flight, and then released again.  The claim is not meant to reach the
+ * disk, but an allocation elsewhere in the group can dirty the buffer
+ * while it is held, so the buffer is dirtied again once the claim is
+ * released, to write the real state over anything that went out.
+ */
+struct ext2_free_extent {
+	struct list_head	fe_list;
+	unsigned int		fe_group;
+	ext2_grpblk_t		fe_start;
+	ext2_grpblk_t		fe_count;
+};
+
+/*
+ * Discard the free runs of at least @minlen blocks in group relative
+ * blocks [start, end) of @group.  Returns the number of blocks trimmed.
+ */
+static long ext2_trim_range(struct super_block *sb, unsigned int group,
+			    ext2_grpblk_t start, ext2_grpblk_t end,
+			    ext2_grpblk_t minlen)
+{
+	spinlock_t *lock = sb_bgl_lock(EXT2_SB(sb), group);
+	ext2_fsblk_t first = ext2_group_first_block_no(sb, group);
+	struct buffer_head *bitmap_bh;
+	ext2_grpblk_t next, i;
+	long trimmed = 0;
+	int err = 0;
+
+	bitmap_bh = ext2_read_block_bitmap(sb, group);
+	if (!bitmap_bh)
+		return -EIO;
+
+	while (start < end) {
+		/* runs too short to trim aren't even claimed */
+		start = ext2_find_zero_run(bitmap_bh->b_data, end, start, minlen);
+		if (start < 0)
+			break;
+		/* claim the run, up to the first bit somebody else holds */
+		for (next = start; next < end; next++)
+			if (ext2_set_bit_atomic(lock, next, bitmap_bh->b_data))
+				break;
+		/* and keep mballoc from steering allocations into it */
+		ext2_mb_update(sb, group, bitmap_bh, start, next - start);
+		if (next - start >= minlen) {
+			err = sb_issue_discard(sb, first + start, next - start,
+					       GFP_NOFS, 0);
+			if (!err)
+				trimmed += next - start;
+		}
+		for (i = start; i < next; i++)
+			ext2_clear_bit_atomic(lock, i, bitmap_bh->b_data);
+		ext2_mb_update(sb, group, bitmap_bh, start, next - start);
+		if (next > start)
+			mark_buffer_dirty(bitmap_bh);
+		if (err)
+			break;
+		start = next + 1;
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+	brelse(bitmap_bh);
+	return err ? err : trimmed;
+}
+
+/**
+ * ext2_trim_fs()
+ * @sb:			superblock
+ * @range:		byte range to trim and minimum run length (FITRIM)
+ *
+ * Discard all free runs of at least range->minlen bytes in the range.
+ * On return range->len holds the number of bytes trimmed.
+ */
+int ext2_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
+	unsigned int bits = sb->s_blocksize_bits;
+	ext2_fsblk_t first_data = le32_to_cpu(es->s_first_data_block);
+	ext2_fsblk_t blocks = le32_to_cpu(es->s_blocks_count);
+	u64 start = range->start >> bits, len = range->len >> bits;
+	u64 trimmed = 0;
+	ext2_fsblk_t last;
+	ext2_grpblk_t minlen;
+	unsigned int group, first_group, last_group;
+	long ret;
+
+	minlen = max_t(u64, range->minlen >> bits, 1);
+	if (start >= blocks || minlen > EXT2_BLOCKS_PER_GROUP(sb))
+		return -EINVAL;
+	/* len is usually ULLONG_MAX, careful with the sum */
+	last = (len > blocks - start) ? blocks - 1 : start + len - 1;
+	if (start < first_data)
+		start = first_data;
+	if (!len || last < start) {
+		range->len = 0;
+		return 0;
+	}
+
+	first_group = (start - first_data) / EXT2_BLOCKS_PER_GROUP(sb);
+	last_group = (last - first_data) / EXT2_BLOCKS_PER_GROUP(sb);
+	for (group = first_group; group <= last_group; group++) {
+		struct ext2_group_desc *desc;
+		ext2_fsblk_t gfirst = ext2_group_first_block_no(sb, group);
+		ext2_grpblk_t from = 0, to = EXT2_BLOCKS_PER_GROUP(sb);
+
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (!desc || le16_to_cpu(desc->bg_free_blocks_count) < minlen)
+			continue;
+		if (group == first_group)
+			from = start - gfirst;
+		if (group == last_group)
+			to = last - gfirst + 1;
+		ret = ext2_trim_range(sb, group, from, to, minlen);
+		if (ret < 0) {
+			range->len = trimmed << bits;
+			return ret;
+		}
+		trimmed += ret;
+	}
+	range->len = trimmed << bits;
+	return 0;
+}
+
+/*
+ * Queue a freed extent for -o discard.  Returns 1 when the queue is big
+ * enough to be trimmed.  Merges with the last extent queued, as a
+ * truncate frees its blocks in order.
+ */
+static int ext2_discard_queue(struct super_block *sb, unsigned int group,
+			      ext2_grpblk_t start, ext2_grpblk_t count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_free_extent *fe, *last;
+	int full;
+
+	fe = kmalloc(sizeof(*fe), GFP_NOFS);
+	spin_lock(&sbi->s_discard_lock);
+	if (!list_empty(&sbi->s_discard_list)) {
+		last = list_entry(sbi->s_discard_list.prev,
+				  struct ext2_free_extent, fe_list);
+		if (last->fe_group == group &&
+		    last->fe_start + last->fe_count == start) {
+			last->fe_count += count;
+			kfree(fe);
+			fe = NULL;
+			goto queued;
+		}
 	}
+	if (!fe) {
+		/* the discard is only a hint, drop it */
+		spin_unlock(&sbi->s_discard_lock);
+		return 0;
+	}
+	fe->fe_group = group;
+	fe->fe_start = start;
+	fe->fe_count = count;
+	list_add_tail(&fe->fe_list, &sbi->s_discard_list);
+queued:
+	sbi->s_discard_blocks += count;
+	full = sbi->s_discard_blocks >= EXT2_DISCARD_BATCH;
+	spin_unlock(&sbi->s_discard_lock);
+	return full;
+}
+
+/**
+ * ext2_discard_flush()
+ * @sb:			superblock
+ *
+ * Trim every extent queued by -o discard.  Blocks that have been
+ * allocated again in the meantime are skipped by the claim in
+ * ext2_trim_range().  The rest of the queue is still trimmed after a
+ * failure; the first error is logged and returned.
+ */
+int ext2_discard_flush(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_free_extent *fe, *tmp;
+	LIST_HEAD(list);
+	long ret;
+	int err = 0;
+
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &list);
+	sbi->s_discard_blocks = 0;
+	spin_unlock(&sbi->s_discard_lock);
+
+	list_for_each_entry_safe(fe, tmp, &list, fe_list) {
+		ret = ext2_trim_range(sb, fe->fe_group, fe->fe_start,
+				      fe->fe_start + fe->fe_count, 1);
+		if (ret < 0 && !err) {
+			err = ret;
+			ext2_msg(sb, KERN_WARNING,
+				 "discard of group %u failed: %d",
+				 fe->fe_group, err);
+		}
+		list_del(&fe->fe_list);
+		kfree(fe);
+	}
+	return err;
+}
+
+/*
+ * A full queue is trimmed from here rather than by whoever freed the
+ * last extent: that may be truncate under truncate_mutex or an xattr
+ * release under the buffer lock.
+ */
+void ext2_discard_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(work, struct ext2_sb_info,
+						s_discard_work);
+	struct super_block *sb = sbi->s_sb;
+
+	if (!(sb->s_flags & MS_RDONLY))
+		ext2_discard_flush(sb);
 }
 
 /**
@@ -487,6 +1169,7 @@ void ext2_free_blocks (struct inode * inode, unsigned long block,
 	struct ext2_group_desc * desc;
 	struct ext2_super_block * es = sbi->s_es;
 	unsigned freed = 0, group_freed;
+	int discard = 0;
 
 	if (block < le32_to_cpu(es->s_first_data_block) ||
 	    block + count < block ||
@@ -514,7 +1197,7 @@ do_more:
 		count -= overflow;
 	}
 	brelse(bitmap_bh);
-	bitmap_bh = read_block_bitmap(sb, block_group);
+	bitmap_bh = ext2_read_block_bitmap(sb, block_group);
 	if (!bitmap_bh)
 		goto error_return;
 
@@ -522,12 +1205,7 @@ do_more:
 	if (!desc)
 		goto error_return;
 
-	if (in_range (le32_to_cpu(desc->bg_block_bitmap), block, count) ||
-	    in_range (le32_to_cpu(desc->bg_inode_bitmap), block, count) ||
-	    in_range (block, le32_to_cpu(desc->bg_inode_table),
-		      sbi->s_itb_per_group) ||
-	    in_range (block + count - 1, le32_to_cpu(desc->bg_inode_table),
-		      sbi->s_itb_per_group)) {
+	if (ext2_in_system_zone(sb, block_group, block, count)) {
 		ext2_error (sb, "ext2_free_blocks",
 			    "Freeing blocks in system zones - "
 			    "Block = %lu, count = %lu",
@@ -548,6 +1226,9 @@ do_more:
 	mark_buffer_dirty(bitmap_bh);
 	if (sb->s_flags & MS_SYNCHRONOUS)
 		sync_dirty_buffer(bitmap_bh);
+	ext2_mb_update(sb, block_group, bitmap_bh, bit, count);
+	if (test_opt(sb, DISCARD) && group_freed)
+		discard |= ext2_discard_queue(sb, block_group, bit, count);
 
 	group_adjust_blocks(sb, block_group, desc, bh2, group_freed);
 	freed += group_freed;
@@ -564,6 +1245,8 @@ error_return:
 		dquot_free_block_nodirty(inode, freed);
 		mark_inode_dirty(inode);
 	}
+	if (discard)
+		schedule_work(&sbi->s_discard_work);
 }
 
 /**
@@ -698,7 +1381,16 @@ ext2_try_to_allocate(struct super_block *sb, int group,
 
 repeat:
 	if (grp_goal < 0) {
-		grp_goal = find_next_usable_block(start, bitmap_bh, end);
+		/*
+		 * ext3301: for a multi-block request go straight for a free
+		 * run that can hold all of it, so the claiming below doesn't
+		 * stop short after a block or two.
+		 */
+		if (*count > 1)
+			grp_goal = ext2_find_zero_run(bitmap_bh->b_data, end,
+				start, min_t(unsigned long, *count, end - start));
+		if (grp_goal < 0)
+			grp_goal = find_next_usable_block(start, bitmap_bh, end);
 		if (grp_goal < 0)
 			goto fail_access;
 		if (!my_rsv) {
@@ -746,8 +1438,10 @@ fail_access:
  *		It does not allocate the reservation window for now:
  *		alloc_new_reservation() will do the work later.
  *
+ * 	@shard: the reservation tree to search, held locked
+ *
  * 	@search_head: the head of the searching list;
- *		This is not necessarily the list head of the whole filesystem
+ *		This is not necessarily the list head of the whole shard
  *
  *		We have both head and start_block to assist the search
  *		for the reservable space. The list starts from head,
@@ -755,6 +1449,8 @@ fail_access:
  *		then start from there, when looking for a reservable space.
  *
  * 	@size: the target new reservation window size
+ *		(may be less than my_rsv->rsv_goal_size, see
+ *		alloc_new_reservation())
  *
  * 	@group_first_block: the first block we consider to start
  *			the real search from
@@ -767,23 +1463,27 @@ fail_access:
  *		This could handle the cross boundary reservation window
  *		request.
  *
+ * 	@stripe: if non-zero, the window must start on a multiple of it
+ *
  * 	basically we search from the given range, rather than the whole
  * 	reservation double linked list, (start_block, last_block)
  * 	to find a free region that is of my size and has not
- * 	been reserved.
+ * 	been reserved.  The window is cut short at the end of the shard.
  *
  */
 static int find_next_reservable_window(
+				struct ext2_rsv_shard *shard,
 				struct ext2_reserve_window_node *search_head,
 				struct ext2_reserve_window_node *my_rsv,
 				struct super_block * sb,
 				ext2_fsblk_t start_block,
-				ext2_fsblk_t last_block)
+				ext2_fsblk_t last_block,
+				unsigned long size,
+				unsigned long stripe)
 {
 	struct rb_node *next;
 	struct ext2_reserve_window_node *rsv, *prev;
 	ext2_fsblk_t cur;
-	int size = my_rsv->rsv_goal_size;
 
 	/* TODO: make the start of the reservation window byte-aligned */
 	/* cur = *start_block & ~7;*/
@@ -795,6 +1495,8 @@ static int find_next_reservable_window(
 	while (1) {
 		if (cur <= rsv->rsv_end)
 			cur = rsv->rsv_end + 1;
+		if (stripe)
+			cur = roundup(cur, stripe);
 
 		/* TODO?
 		 * in the case we could not find a reservable space
@@ -839,7 +1541,7 @@ static int find_next_reservable_window(
 	 */
 
 	if ((prev != my_rsv) && (!rsv_is_empty(&my_rsv->rsv_window)))
-		rsv_window_remove(sb, my_rsv);
+		rsv_window_remove(shard, my_rsv);
 
 	/*
 	 * Let's book the whole available window for now.  We will check the
@@ -849,11 +1551,13 @@ static int find_next_reservable_window(
 	 * call find_next_reservable_window.
 	 */
 	my_rsv->rsv_start = cur;
-	my_rsv->rsv_end = cur + size - 1;
+	my_rsv->rsv_end = min(cur + size - 1, shard->rs_last_block);
 	my_rsv->rsv_alloc_hit = 0;
 
-	if (prev != my_rsv)
-		ext2_rsv_window_add(sb, my_rsv);
+	if (prev != my_rsv) {
+		ext2_rsv_window_add(shard, my_rsv);
+		shard->rs_windows++;
+	}
 
 	return 0;
 }
@@ -902,10 +1606,12 @@ static int alloc_new_reservation(struct ext2_reserve_window_node *my_rsv,
 	struct ext2_reserve_window_node *search_head;
 	ext2_fsblk_t group_first_block, group_end_block, start_block;
 	ext2_grpblk_t first_free_block;
-	struct rb_root *fs_rsv_root = &EXT2_SB(sb)->s_rsv_window_root;
-	unsigned long size;
+	struct ext2_rsv_shard *shard = rsv_group_shard(sb, group);
+	struct ext2_rsv_shard *old_shard;
+	unsigned long size, stripe;
+	unsigned int windows;
 	int ret;
-	spinlock_t *rsv_lock = &EXT2_SB(sb)->s_rsv_window_lock;
+	spinlock_t *rsv_lock = &shard->rs_lock;
 
 	group_first_block = ext2_group_first_block_no(sb, group);
 	group_end_block = group_first_block + (EXT2_BLOCKS_PER_GROUP(sb) - 1);
@@ -950,13 +1656,59 @@ static int alloc_new_reservation(struct ext2_reserve_window_node *my_rsv,
 				size = EXT2_MAX_RESERVE_BLOCKS;
 			my_rsv->rsv_goal_size= size;
 		}
+
+		/*
+		 * A window in another shard's tree has to be dropped under
+		 * that shard's lock before we look for one in this shard.
+		 */
+		old_shard = rsv_block_shard(sb, my_rsv->rsv_start);
+		if (old_shard != shard) {
+			spin_lock(&old_shard->rs_lock);
+			rsv_window_remove(old_shard, my_rsv);
+			spin_unlock(&old_shard->rs_lock);
+		}
+	}
+
+	/*
+	 * ext3301: with several writers in the shard, don't let one grown
+	 * window take more than its share of what the group has left; the
+	 * others would only spill into other groups.  Unlocked reads, this
+	 * is just a hint, but the count is read once: another CPU may drop
+	 * it to 0 between the test and the division.
+	 */
+	windows = ACCESS_ONCE(shard->rs_windows);
+	if (windows > 1 &&
+	    !(container_of(my_rsv, struct ext2_block_alloc_info,
+			   rsv_window_node)->rsv_flags & EXT2_RSV_FIXED)) {
+		struct ext2_group_desc *desc;
+		unsigned long share;
+
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (desc) {
+			share = le16_to_cpu(desc->bg_free_blocks_count) /
+				windows;
+			share = max_t(unsigned long, share,
+				      EXT2_DEFAULT_RESERVE_BLOCKS);
+			size = min(size, share);
+		}
 	}
 
+	/*
+	 * ext3301: on RAID, a window that covers at least a stripe is
+	 * made whole stripes and starts on a stripe boundary, so streaming
+	 * writes go out as full-stripe writes without read-modify-write.
+	 */
+	stripe = ext2_stripe(sb);
+	if (stripe && size >= stripe)
+		size = roundup(size, stripe);
+	else
+		stripe = 0;
+
 	spin_lock(rsv_lock);
 	/*
 	 * shift the search start to the window near the goal block
 	 */
-	search_head = search_reserve_window(fs_rsv_root, start_block);
+	search_head = search_reserve_window(&shard->rs_root, start_block);
 
 	/*
 	 * find_next_reservable_window() simply finds a reservable window
@@ -966,12 +1718,12 @@ static int alloc_new_reservation(struct ext2_reserve_window_node *my_rsv,
 	 * need to check the bitmap after we found a reservable window.
 	 */
 retry:
-	ret = find_next_reservable_window(search_head, my_rsv, sb,
-						start_block, group_end_block);
+	ret = find_next_reservable_window(shard, search_head, my_rsv, sb,
+					start_block, group_end_block, size, stripe);
 
 	if (ret == -1) {
 		if (!rsv_is_empty(&my_rsv->rsv_window))
-			rsv_window_remove(sb, my_rsv);
+			rsv_window_remove(shard, my_rsv);
 		spin_unlock(rsv_lock);
 		return -1;
 	}
@@ -997,7 +1749,7 @@ retry:
 		 */
 		spin_lock(rsv_lock);
 		if (!rsv_is_empty(&my_rsv->rsv_window))
-			rsv_window_remove(sb, my_rsv);
+			rsv_window_remove(shard, my_rsv);
 		spin_unlock(rsv_lock);
 		return -1;		/* failed */
 	}
@@ -1035,14 +1787,16 @@ retry:
  * window. To make this more efficient, given the total number of
  * blocks needed and the current size of the window, we try to
  * expand the reservation window size if necessary on a best-effort
- * basis before ext2_new_blocks() tries to allocate blocks.
+ * basis before ext2_new_blocks() tries to allocate blocks.  The window
+ * doesn't grow past the end of its shard.
  */
 static void try_to_extend_reservation(struct ext2_reserve_window_node *my_rsv,
 			struct super_block *sb, int size)
 {
 	struct ext2_reserve_window_node *next_rsv;
 	struct rb_node *next;
-	spinlock_t *rsv_lock = &EXT2_SB(sb)->s_rsv_window_lock;
+	struct ext2_rsv_shard *shard = rsv_block_shard(sb, my_rsv->rsv_start);
+	spinlock_t *rsv_lock = &shard->rs_lock;
 
 	if (!spin_trylock(rsv_lock))
 		return;
@@ -1050,7 +1804,8 @@ static void try_to_extend_reservation(struct ext2_reserve_window_node *my_rsv,
 	next = rb_next(&my_rsv->rsv_node);
 
 	if (!next)
-		my_rsv->rsv_end += size;
+		my_rsv->rsv_end = min(my_rsv->rsv_end + size,
+				      shard->rs_last_block);
 	else {
 		next_rsv = rb_entry(next, struct ext2_reserve_window_node, rsv_node);
 
@@ -1157,7 +1912,8 @@ ext2_try_to_allocate_with_rsv(struct super_block *sb, unsigned int group,
 
 		if ((my_rsv->rsv_start > group_last_block) ||
 				(my_rsv->rsv_end < group_first_block)) {
-			rsv_window_dump(&EXT2_SB(sb)->s_rsv_window_root, 1);
+			rsv_window_dump(&rsv_block_shard(sb,
+					my_rsv->rsv_start)->rs_root, 1);
 			BUG();
 		}
 		ret = ext2_try_to_allocate(sb, group, bitmap_bh, grp_goal,
@@ -1175,16 +1931,21 @@ ext2_try_to_allocate_with_rsv(struct super_block *sb, unsigned int group,
 /**
  * ext2_has_free_blocks()
  * @sbi:		in-core super block structure.
+ * @nblocks:		number of blocks wanted
  *
- * Check if filesystem has at least 1 free block available for allocation.
+ * Check if filesystem has at least @nblocks free blocks available for
+ * allocation.  Blocks promised to delayed allocation don't count as free.
  */
-static int ext2_has_free_blocks(struct ext2_sb_info *sbi)
+int ext2_has_free_blocks(struct ext2_sb_info *sbi, s64 nblocks)
 {
-	ext2_fsblk_t free_blocks, root_blocks;
+	s64 free_blocks, root_blocks;
 
-	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+	free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+		percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
 	root_blocks = le32_to_cpu(sbi->s_es->s_r_blocks_count);
-	if (free_blocks < root_blocks + 1 && !capable(CAP_SYS_RESOURCE) &&
+	if (free_blocks < nblocks)
+		return 0;
+	if (free_blocks < root_blocks + nblocks && !capable(CAP_SYS_RESOURCE) &&
 		!uid_eq(sbi->s_resuid, current_fsuid()) &&
 		(gid_eq(sbi->s_resgid, GLOBAL_ROOT_GID) ||
 		 !in_group_p (sbi->s_resgid))) {
@@ -1209,6 +1970,18 @@ static int ext2_has_free_blocks(struct ext2_sb_info *sbi)
  */
 ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 		    unsigned long *count, int *errp)
+{
+	return ext2_new_blocks_da(inode, goal, count, ~0UL, errp);
+}
+
+/*
+ * ext3301: ext2_new_blocks() for delayed allocation.  Only the first
+ * @meta blocks, the indirect ones, are charged to quota here; the data
+ * blocks after them were reserved at write time, and that reservation
+ * is claimed.
+ */
+ext2_fsblk_t ext2_new_blocks_da(struct inode *inode, ext2_fsblk_t goal,
+		    unsigned long *count, unsigned long meta, int *errp)
 {
 	struct buffer_head *bitmap_bh = NULL;
 	struct buffer_head *gdp_bh;
@@ -1229,6 +2002,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 	unsigned short windowsz = 0;
 	unsigned long ngroups;
 	unsigned long num = *count;
+	unsigned long charged = min(num, meta);
 	int ret;
 
 	*errp = -ENOSPC;
@@ -1237,7 +2011,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 	/*
 	 * Check quota for allocation of this block.
 	 */
-	ret = dquot_alloc_block(inode, num);
+	ret = dquot_alloc_block(inode, charged);
 	if (ret) {
 		*errp = ret;
 		return 0;
@@ -1249,7 +2023,7 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 	/*
 	 * Allocate a block from reservation only when
 	 * filesystem is mounted with reservation(default,-o reservation), and
-	 * it's a regular file, and
+	 * it's a regular file or a directory, and
 	 * the desired window size is greater than 0 (One could use ioctl
 	 * command EXT2_IOC_SETRSVSZ to set the window size to 0 to turn off
 	 * reservation on that particular file)
@@ -1261,11 +2035,18 @@ ext2_fsblk_t ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
 			my_rsv = &block_i->rsv_window_node;
 	}
 
-	if (!ext2_has_free_blocks(sbi)) {
+	if (!ext2_has_free_blocks(sbi, 1)) {
 		*errp = -ENOSPC;
 		goto out;
 	}
 
+	/*
+	 * ext3301: with mballoc, let the buddy summaries steer a multi-block
+	 * request towards a free run big enough for it.
+	 */
+	if (test_opt(sb, MBALLOC))
+		goal = ext2_mb_find_goal(sb, goal, num);
+
 	/*
 	 * First, test whether the goal block is free.
 	 */
@@ -1293,7 +2074,7 @@ retry_alloc:
 	if (free_blocks > 0) {
 		grp_target_blk = ((goal - le32_to_cpu(es->s_first_data_block)) %
 				EXT2_BLOCKS_PER_GROUP(sb));
-		bitmap_bh = read_block_bitmap(sb, group_no);
+		bitmap_bh = ext2_read_block_bitmap(sb, group_no);
 		if (!bitmap_bh)
 			goto io_error;
 		grp_alloc_blk = ext2_try_to_allocate_with_rsv(sb, group_no,
@@ -1333,8 +2114,11 @@ retry_alloc:
 		if (my_rsv && (free_blocks <= (windowsz/2)))
 			continue;
 
+		/* ext3301: the next group's bitmap reads while we look */
+		ext2_bitmap_prefetch(sb, group_no + 1 < ngroups ?
+					 group_no + 1 : 0);
 		brelse(bitmap_bh);
-		bitmap_bh = read_block_bitmap(sb, group_no);
+		bitmap_bh = ext2_read_block_bitmap(sb, group_no);
 		if (!bitmap_bh)
 			goto io_error;
 		/*
@@ -1369,12 +2153,7 @@ allocated:
 
 	ret_block = grp_alloc_blk + ext2_group_first_block_no(sb, group_no);
 
-	if (in_range(le32_to_cpu(gdp->bg_block_bitmap), ret_block, num) ||
-	    in_range(le32_to_cpu(gdp->bg_inode_bitmap), ret_block, num) ||
-	    in_range(ret_block, le32_to_cpu(gdp->bg_inode_table),
-		      EXT2_SB(sb)->s_itb_per_group) ||
-	    in_range(ret_block + num - 1, le32_to_cpu(gdp->bg_inode_table),
-		      EXT2_SB(sb)->s_itb_per_group)) {
+	if (ext2_in_system_zone(sb, group_no, ret_block, num)) {
 		ext2_error(sb, "ext2_new_blocks",
 			    "Allocating block in system zone - "
 			    "blocks from "E2FSBLK", length %lu",
@@ -1399,6 +2178,7 @@ allocated:
 
 	group_adjust_blocks(sb, group_no, gdp, gdp_bh, -num);
 	percpu_counter_sub(&sbi->s_freeblocks_counter, num);
+	ext2_mb_update(sb, group_no, bitmap_bh, grp_alloc_blk, num);
 
 	mark_buffer_dirty(bitmap_bh);
 	if (sb->s_flags & MS_SYNCHRONOUS)
@@ -1407,10 +2187,13 @@ allocated:
 	*errp = 0;
 	brelse(bitmap_bh);
 	if (num < *count) {
-		dquot_free_block_nodirty(inode, *count-num);
+		if (charged > min(num, meta))
+			dquot_free_block_nodirty(inode, charged - min(num, meta));
 		mark_inode_dirty(inode);
 		*count = num;
 	}
+	if (num > meta)
+		dquot_claim_block(inode, num - meta);
 	return ret_block;
 
 io_error:
@@ -1420,13 +2203,59 @@ out:
 	 * Undo the block allocation
 	 */
 	if (!performed_allocation) {
-		dquot_free_block_nodirty(inode, *count);
+		dquot_free_block_nodirty(inode, charged);
 		mark_inode_dirty(inode);
 	}
 	brelse(bitmap_bh);
 	return 0;
 }
 
+/**
+ * ext2_find_free_run()
+ * @sb:			superblock
+ * @goal:		where to start looking (filesystem wide)
+ * @count:		length of the run wanted
+ *
+ * ext3301: look for @count free blocks in a row at or after @goal in its
+ * group, then in the groups after it.  Nothing is claimed; the caller
+ * still has to allocate the run, and may find it taken by then.
+ * Returns its first block, or 0 if there is no such run.
+ */
+ext2_fsblk_t ext2_find_free_run(struct super_block *sb, ext2_fsblk_t goal,
+				unsigned long count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_super_block *es = sbi->s_es;
+	ext2_fsblk_t first_data = le32_to_cpu(es->s_first_data_block);
+	ext2_fsblk_t blocks = le32_to_cpu(es->s_blocks_count);
+	struct ext2_group_desc *desc;
+	struct buffer_head *bitmap_bh;
+	ext2_grpblk_t grp_goal, end, start;
+	unsigned int group;
+
+	if (goal < first_data || goal >= blocks)
+		goal = first_data;
+	group = (goal - first_data) / EXT2_BLOCKS_PER_GROUP(sb);
+	grp_goal = (goal - first_data) % EXT2_BLOCKS_PER_GROUP(sb);
+
+	for (; group < sbi->s_groups_count; group++, grp_goal = 0) {
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (!desc || le16_to_cpu(desc->bg_free_blocks_count) < count)
+			continue;
+		bitmap_bh = ext2_read_block_bitmap(sb, group);
+		if (!bitmap_bh)
+			continue;
+		end = min_t(ext2_fsblk_t, EXT2_BLOCKS_PER_GROUP(sb),
+			    blocks - ext2_group_first_block_no(sb, group));
+		start = ext2_find_zero_run(bitmap_bh->b_data, end, grp_goal,
+					   count);
+		brelse(bitmap_bh);
+		if (start >= 0)
+			return ext2_group_first_block_no(sb, group) + start;
+	}
+	return 0;
+}
+
 ext2_fsblk_t ext2_new_block(struct inode *inode, unsigned long goal, int *errp)
 {
 	unsigned long count = 1;
@@ -1434,15 +2263,6 @@ ext2_fsblk_t ext2_new_block(struct inode *inode, unsigned long goal, int *errp)
 	return ext2_new_blocks(inode, goal, &count, errp);
 }
 
-#ifdef EXT2FS_DEBUG
-
-unsigned long ext2_count_free(struct buffer_head *map, unsigned int numchars)
-{
-	return numchars * BITS_PER_BYTE - memweight(map->b_data, numchars);
-}
-
-#endif  /*  EXT2FS_DEBUG  */
-
 unsigned long ext2_count_free_blocks (struct super_block * sb)
 {
 	struct ext2_group_desc * desc;
@@ -1462,7 +2282,7 @@ unsigned long ext2_count_free_blocks (struct super_block * sb)
 		if (!desc)
 			continue;
 		desc_count += le16_to_cpu(desc->bg_free_blocks_count);
-		bitmap_bh = read_block_bitmap(sb, i);
+		bitmap_bh = ext2_read_block_bitmap(sb, i);
 		if (!bitmap_bh)
 			continue;
 		
@@ -0,0 +1,274 @@
+/*
+ *  linux/fs/ext2/bitmap.c
+ *  Added to ext2 as part of the ext3301 improvements
+ *
+ *  Scanning of on-disk (little-endian) block and inode bitmaps.  All of
+ *  it goes through find_next_bit_le()/find_next_zero_bit_le() and
+ *  memweight(), which work a machine word at a time, so long runs of
+ *  free or used space are skipped 64 bits per step.
+ *
+ *  Also the cache of pinned block bitmaps (bitmap_pin=N).
+ */
+
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/buffer_head.h>
+#include "ext2.h"
+
+#ifdef EXT2FS_DEBUG
+
+unsigned long ext2_count_free(struct buffer_head *map, unsigned int numchars)
+{
+	return numchars * BITS_PER_BYTE - memweight(map->b_data, numchars);
+}
+
+#endif  /*  EXT2FS_DEBUG  */
+
+/**
+ * ext2_find_zero_run()
+ * @bitmap:		on-disk bitmap
+ * @size:		number of bits in the bitmap
+ * @start:		where to start looking
+ * @want:		length of the run wanted
+ *
+ * Find the first run of at least @want zero bits that starts at or after
+ * @start.  Returns its first bit, or -1 if there is no such run.  Only
+ * @want bits of each candidate run are looked at, so a huge free area
+ * costs no more than a short one.
+ */
+ext2_grpblk_t ext2_find_zero_run(const void *bitmap, ext2_grpblk_t size,
+				 ext2_grpblk_t start, ext2_grpblk_t want)
+{
+	ext2_grpblk_t limit, end;
+
+	if (want < 1)
+		want = 1;
+	while (start < size) {
+		start = ext2_find_next_zero_bit(bitmap, size, start);
+		if (start >= size || size - start < want)
+			break;
+		limit = start + want;
+		end = ext2_find_next_bit(bitmap, limit, start);
+		if (end >= limit)
+			return start;
+		start = end + 1;
+	}
+	return -1;
+}
+
+/*
+ * ext3301: block bitmap cache.
+ *
+ * The allocator reads a group's block bitmap each time it looks at the
+ * group.  That is normally a buffer cache hit, but bitmap buffers are
+ * reclaimed like any other clean buffer, and under memory pressure
+ * allocation then stalls on synchronous reads.  With bitmap_pin=N up to
+ * N bitmaps are held with an extra reference, so they stay in memory.
+ *
+ * Slots are recycled with the CLOCK algorithm: a hit sets the slot's
+ * referenced bit, and the hand clears bits as it goes round until it
+ * finds a slot nobody used since its last pass.  The shrinker works the
+ * same hand, so the VM can take back cold bitmaps but not hot ones.
+ * A bitmap is validated when it is read from disk, so a pinned one is
+ * validated only once.
+ */
+struct ext2_bitmap_slot {
+	unsigned int		bs_group;
+	struct buffer_head	*bs_bh;		/* NULL while the slot is free */
+	int			bs_referenced;
+};
+
+struct ext2_bitmap_cache {
+	spinlock_t		bc_lock;
+	unsigned int		bc_size;
+	unsigned int		bc_hand;
+	unsigned int		bc_used;
+	int			*bc_group_slot;	/* per group, -1 if not cached */
+	struct shrinker		bc_shrinker;
+	struct ext2_bitmap_slot	bc_slots[0];
+};
+
+/* Advance the hand to a free or unreferenced slot.  bc_lock held. */
+static unsigned int ext2_bitmap_clock(struct ext2_bitmap_cache *bc)
+{
+	for (;;) {
+		unsigned int slot = bc->bc_hand;
+		struct ext2_bitmap_slot *s = &bc->bc_slots[slot];
+
+		if (++bc->bc_hand == bc->bc_size)
+			bc->bc_hand = 0;
+		if (!s->bs_bh || !s->bs_referenced)
+			return slot;
+		s->bs_referenced = 0;
+	}
+}
+
+/* Empty a slot.  bc_lock held. */
+static void ext2_bitmap_evict(struct ext2_bitmap_cache *bc,
+			      struct ext2_bitmap_slot *s)
+{
+	bc->bc_group_slot[s->bs_group] = -1;
+	brelse(s->bs_bh);
+	s->bs_bh = NULL;
+	bc->bc_used--;
+}
+
+/**
+ * ext2_bitmap_cache_get()
+ * @sb:			superblock
+ * @group:		block group
+ *
+ * Return the pinned block bitmap of @group with a reference taken, or
+ * NULL if it isn't pinned.
+ */
+struct buffer_head *ext2_bitmap_cache_get(struct super_block *sb,
+					  unsigned int group)
+{
+	struct ext2_bitmap_cache *bc = EXT2_SB(sb)->s_bitmap_cache;
+	struct buffer_head *bh = NULL;
+	int slot;
+
+	if (!bc)
+		return NULL;
+	spin_lock(&bc->bc_lock);
+	slot = bc->bc_group_slot[group];
+	if (slot >= 0) {
+		bc->bc_slots[slot].bs_referenced = 1;
+		bh = bc->bc_slots[slot].bs_bh;
+		get_bh(bh);
+	}
+	spin_unlock(&bc->bc_lock);
+	return bh;
+}
+
+/**
+ * ext2_bitmap_cache_add()
+ * @sb:			superblock
+ * @group:		block group
+ * @bh:			its block bitmap, uptodate and validated
+ *
+ * Pin the bitmap, taking a slot from a colder group if need be.  The
+ * caller keeps its own reference.
+ */
+void ext2_bitmap_cache_add(struct super_block *sb, unsigned int group,
+			   struct buffer_head *bh)
+{
+	struct ext2_bitmap_cache *bc = EXT2_SB(sb)->s_bitmap_cache;
+	struct ext2_bitmap_slot *s;
+
+	if (!bc)
+		return;
+	spin_lock(&bc->bc_lock);
+	if (bc->bc_group_slot[group] < 0) {
+		s = &bc->bc_slots[ext2_bitmap_clock(bc)];
+		if (s->bs_bh)
+			ext2_bitmap_evict(bc, s);
+		get_bh(bh);
+		s->bs_bh = bh;
+		s->bs_group = group;
+		s->bs_referenced = 1;
+		bc->bc_group_slot[group] = s - bc->bc_slots;
+		bc->bc_used++;
+	}
+	spin_unlock(&bc->bc_lock);
+}
+
+/**
+ * ext2_bitmap_prefetch()
+ * @sb:			superblock
+ * @group:		block group
+ *
+ * Start reading the block bitmap of @group, which the allocator is
+ * likely to look at next, unless it is full, already in memory or not on
+ * disk at all (BLOCK_UNINIT).
+ */
+void ext2_bitmap_prefetch(struct super_block *sb, unsigned int group)
+{
+	struct ext2_bitmap_cache *bc = EXT2_SB(sb)->s_bitmap_cache;
+	struct ext2_group_desc *desc;
+
+	if (bc && bc->bc_group_slot[group] >= 0)
+		return;
+	desc = ext2_get_group_desc(sb, group, NULL);
+	if (!desc || !desc->bg_free_blocks_count ||
+	    (ext2_bg_flags(sb, desc) & EXT2_BG_BLOCK_UNINIT))
+		return;
+	sb_breadahead(sb, le32_to_cpu(desc->bg_block_bitmap));
+}
+
+static int ext2_bitmap_shrink(struct shrinker *shrink,
+			      struct shrink_control *sc)
+{
+	struct ext2_bitmap_cache *bc =
+		container_of(shrink, struct ext2_bitmap_cache, bc_shrinker);
+	unsigned long nr = sc->nr_to_scan;
+	unsigned int i;
+	int used;
+
+	spin_lock(&bc->bc_lock);
+	for (i = 0; nr && bc->bc_used && i < 2 * bc->bc_size; i++) {
+		struct ext2_bitmap_slot *s = &bc->bc_slots[bc->bc_hand];
+
+		if (++bc->bc_hand == bc->bc_size)
+			bc->bc_hand = 0;
+		if (!s->bs_bh)
+			continue;
+		nr--;
+		if (s->bs_referenced)
+			s->bs_referenced = 0;
+		else
+			ext2_bitmap_evict(bc, s);
+	}
+	used = bc->bc_used;
+	spin_unlock(&bc->bc_lock);
+	return used;
+}
+
+int ext2_bitmap_cache_init(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_bitmap_cache *bc;
+	unsigned int size = min_t(unsigned long, sbi->s_bitmap_pin,
+				  sbi->s_groups_count);
+	unsigned long i;
+
+	sbi->s_bitmap_pin = size;
+	if (!size)
+		return 0;
+	bc = kzalloc(sizeof(*bc) + size * sizeof(bc->bc_slots[0]),
+		     GFP_KERNEL);
+	if (!bc)
+		return -ENOMEM;
+	bc->bc_group_slot = vmalloc(sbi->s_groups_count * sizeof(int));
+	if (!bc->bc_group_slot) {
+		kfree(bc);
+		return -ENOMEM;
+	}
+	for (i = 0; i < sbi->s_groups_count; i++)
+		bc->bc_group_slot[i] = -1;
+	spin_lock_init(&bc->bc_lock);
+	bc->bc_size = size;
+	bc->bc_shrinker.shrink = ext2_bitmap_shrink;
+	bc->bc_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&bc->bc_shrinker);
+	sbi->s_bitmap_cache = bc;
+	return 0;
+}
+
+void ext2_bitmap_cache_release(struct super_block *sb)
+{
+	struct ext2_bitmap_cache *bc = EXT2_SB(sb)->s_bitmap_cache;
+	unsigned int i;
+
+	if (!bc)
+		return;
+	unregister_shrinker(&bc->bc_shrinker);
+	for (i = 0; i < bc->bc_size; i++)
+		brelse(bc->bc_slots[i].bs_bh);
+	vfree(bc->bc_group_slot);
+	kfree(bc);
+	EXT2_SB(sb)->s_bitmap_cache = NULL;
+}
@@ -25,6 +25,11 @@
 #include <linux/buffer_head.h>
 #include <linux/pagemap.h>
 #include <linux/swap.h>
+#include <linux/sort.h>
+#include <linux/blkdev.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <asm/uaccess.h>
 
 typedef struct ext2_dir_entry_2 ext2_dirent;
 
@@ -105,9 +110,8 @@ static int ext2_commit_chunk(struct page *page, loff_t pos, unsigned len)
 	}
 
 	if (IS_DIRSYNC(dir)) {
-		err = write_one_page(page, 1);
-		if (!err)
-			err = sync_inode_metadata(dir, 1);
+		/* ext3301: batched with concurrent DIRSYNC updates */
+		err = ext2_dirsync_commit(dir, page);
 	} else {
 		unlock_page(page);
 	}
@@ -218,19 +222,54 @@ fail:
 	return ERR_PTR(-EIO);
 }
 
+/*
+ * ext3301: name matching.  The wanted name is turned into a key once per
+ * lookup, holding its first four bytes as a word and a mask covering
+ * names shorter than that.  Records are then rejected on name_len and a
+ * single aligned word load before memcmp() ever runs.  That load is
+ * always safe: dirents are 4-byte aligned, and even the shortest record
+ * (EXT2_DIR_REC_LEN(1)) holds four bytes of name.  Only the mask makes the
+ * comparison independent of whatever padding follows a short name.
+ */
+struct ext2_match_key {
+	const char	*name;
+	int		len;
+	u32		head;
+	u32		mask;
+};
+
+static inline void ext2_match_key_init(struct ext2_match_key *key,
+				       const char *name, int len)
+{
+	union { u32 w; u8 b[4]; } head = { .w = 0 }, mask = { .w = 0 };
+	int i;
+
+	for (i = 0; i < len && i < 4; i++) {
+		head.b[i] = name[i];
+		mask.b[i] = 0xff;
+	}
+	key->name = name;
+	key->len = len;
+	key->head = head.w;
+	key->mask = mask.w;
+}
+
 /*
  * NOTE! unlike strncmp, ext2_match returns 1 for success, 0 for failure.
  *
- * len <= EXT2_NAME_LEN and de != NULL are guaranteed by caller.
+ * key->len <= EXT2_NAME_LEN and de != NULL are guaranteed by caller.
  */
-static inline int ext2_match (int len, const char * const name,
-					struct ext2_dir_entry_2 * de)
+static inline int ext2_match(const struct ext2_match_key *key,
+			     struct ext2_dir_entry_2 *de)
 {
-	if (len != de->name_len)
+	if (key->len != de->name_len)
 		return 0;
 	if (!de->inode)
 		return 0;
-	return !memcmp(name, de->name, len);
+	if ((*(u32 *)de->name & key->mask) != key->head)
+		return 0;
+	return key->len <= 4 ||
+		!memcmp(key->name + 4, de->name + 4, key->len - 4);
 }
 
 /*
@@ -359,6 +398,393 @@ ext2_readdir (struct file * filp, void * dirent, filldir_t filldir)
 	return 0;
 }
 
+/*
+ * ext3301: directory bloom filters.
+ *
+ * Most lookups in a file-creation burst are for names that do not exist,
+ * and proving that means reading the whole directory.  Once a large
+ * directory has been scanned end to end without a match, we build a bloom
+ * filter over its names.  ext2_add_link() keeps it current.  Deletions
+ * leave stale bits behind, which only cost false positives; once those
+ * pile up, the filter is dropped and rebuilt on the next full miss.
+ *
+ * A filter gets roughly one bit per two bytes of directory, or eight bits
+ * per name for typical name lengths.  The filesystem-wide total is capped
+ * by the bloom_mem= mount option.
+ */
+struct ext2_dir_bloom {
+	unsigned int	db_bits;	/* power of two */
+	unsigned int	db_entries;	/* names added */
+	unsigned int	db_capacity;	/* names it was sized for */
+	atomic_t	db_false;	/* false positives seen */
+	size_t		db_size;	/* bytes, for accounting */
+	unsigned long	db_map[];
+};
+
+#define EXT2_BLOOM_MIN_SIZE	(16 * PAGE_CACHE_SIZE)
+#define EXT2_BLOOM_PROBES	4
+#define EXT2_BLOOM_SEED		0x65787432
+
+static struct ext2_dir_bloom *ext2_bloom_alloc(struct inode *dir)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct ext2_dir_bloom *db;
+	unsigned int bits;
+	size_t size;
+
+	if (dir->i_size < EXT2_BLOOM_MIN_SIZE || dir->i_size > (1U << 31))
+		return NULL;
+	bits = roundup_pow_of_two(dir->i_size / 2);
+	size = sizeof(*db) + bits / 8;
+
+	spin_lock(&sbi->s_bloom_lock);
+	if (sbi->s_bloom_mem + size > sbi->s_bloom_max) {
+		spin_unlock(&sbi->s_bloom_lock);
+		return NULL;
+	}
+	sbi->s_bloom_mem += size;
+	sbi->s_bloom_filters++;
+	spin_unlock(&sbi->s_bloom_lock);
+
+	if (size <= PAGE_SIZE)
+		db = kzalloc(size, GFP_NOFS);
+	else
+		db = __vmalloc(size, GFP_NOFS | __GFP_HIGHMEM | __GFP_ZERO,
+			       PAGE_KERNEL);
+	if (!db) {
+		spin_lock(&sbi->s_bloom_lock);
+		sbi->s_bloom_mem -= size;
+		sbi->s_bloom_filters--;
+		spin_unlock(&sbi->s_bloom_lock);
+		return NULL;
+	}
+	db->db_bits = bits;
+	db->db_capacity = bits / 8;
+	db->db_size = size;
+	return db;
+}
+
+static void ext2_bloom_release(struct super_block *sb,
+			       struct ext2_dir_bloom *db)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	spin_lock(&sbi->s_bloom_lock);
+	sbi->s_bloom_mem -= db->db_size;
+	sbi->s_bloom_filters--;
+	spin_unlock(&sbi->s_bloom_lock);
+	if (is_vmalloc_addr(db))
+		vfree(db);
+	else
+		kfree(db);
+}
+
+/* Swap in a new filter (or none) and free the old one */
+static void ext2_bloom_install(struct inode *dir, struct ext2_dir_bloom *db)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_bloom *old;
+
+	write_lock(&ei->i_meta_lock);
+	old = ei->i_dir_bloom;
+	ei->i_dir_bloom = db;
+	write_unlock(&ei->i_meta_lock);
+	if (old)
+		ext2_bloom_release(dir->i_sb, old);
+}
+
+void ext2_dir_bloom_free(struct inode *dir)
+{
+	if (EXT2_I(dir)->i_dir_bloom)
+		ext2_bloom_install(dir, NULL);
+}
+
+static inline void ext2_bloom_hash(const char *name, int len,
+				   u32 *h1, u32 *h2)
+{
+	*h1 = full_name_hash(name, len);
+	*h2 = jhash(name, len, EXT2_BLOOM_SEED) | 1;
+}
+
+static void ext2_bloom_set(struct ext2_dir_bloom *db, const char *name,
+			   int len)
+{
+	u32 h1, h2;
+	int i;
+
+	ext2_bloom_hash(name, len, &h1, &h2);
+	for (i = 0; i < EXT2_BLOOM_PROBES; i++, h1 += h2)
+		set_bit(h1 & (db->db_bits - 1), db->db_map);
+	db->db_entries++;
+}
+
+/*
+ * Returns 0 if @name is definitely not in @dir, 1 if it may be, and -1 if
+ * the directory has no filter.
+ */
+static int ext2_bloom_test(struct inode *dir, const char *name, int len)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_bloom *db;
+	int ret = -1;
+	u32 h1, h2;
+	int i;
+
+	if (!ei->i_dir_bloom)
+		return -1;
+	ext2_bloom_hash(name, len, &h1, &h2);
+	read_lock(&ei->i_meta_lock);
+	db = ei->i_dir_bloom;
+	if (db) {
+		ret = 1;
+		for (i = 0; i < EXT2_BLOOM_PROBES; i++, h1 += h2) {
+			if (!test_bit(h1 & (db->db_bits - 1), db->db_map)) {
+				ret = 0;
+				break;
+			}
+		}
+	}
+	read_unlock(&ei->i_meta_lock);
+	if (!ret)
+		atomic_long_inc(&EXT2_SB(dir->i_sb)->s_bloom_hits);
+	return ret;
+}
+
+/* Parent is locked. */
+static void ext2_bloom_add(struct inode *dir, const char *name, int len)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	struct ext2_dir_bloom *db;
+	int full = 0;
+
+	if (!ei->i_dir_bloom)
+		return;
+	read_lock(&ei->i_meta_lock);
+	db = ei->i_dir_bloom;
+	if (db) {
+		ext2_bloom_set(db, name, len);
+		full = db->db_entries > db->db_capacity;
+	}
+	read_unlock(&ei->i_meta_lock);
+	/* Outgrown; the next full miss builds a bigger one */
+	if (full)
+		ext2_bloom_install(dir, NULL);
+}
+
+/*
+ * A lookup walked the whole directory without finding its name.  Count a
+ * false positive if the filter let it through; otherwise this is our cue
+ * to build one.  Parent is locked.
+ */
+static void ext2_bloom_miss(struct inode *dir, int had_filter)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	unsigned long i, npages = dir_pages(dir);
+	struct ext2_dir_bloom *db;
+
+	if (had_filter > 0) {
+		int stale = 0;
+
+		atomic_long_inc(&EXT2_SB(dir->i_sb)->s_bloom_false);
+		read_lock(&ei->i_meta_lock);
+		db = ei->i_dir_bloom;
+		if (db)
+			stale = atomic_inc_return(&db->db_false) >
+						db->db_capacity / 16;
+		read_unlock(&ei->i_meta_lock);
+		if (stale)
+			ext2_bloom_install(dir, NULL);
+		return;
+	}
+
+	db = ext2_bloom_alloc(dir);
+	if (!db)
+		return;
+	for (i = 0; i < npages; i++) {
+		char *kaddr, *limit;
+		ext2_dirent *de;
+		struct page *page = ext2_get_page(dir, i, 1);
+
+		if (IS_ERR(page))
+			goto fail;
+		kaddr = page_address(page);
+		limit = kaddr + ext2_last_byte(dir, i) - EXT2_DIR_REC_LEN(1);
+		for (de = (ext2_dirent *)kaddr; (char *)de <= limit;
+		     de = ext2_next_entry(de)) {
+			if (de->rec_len == 0) {
+				ext2_put_page(page);
+				goto fail;
+			}
+			if (de->inode)
+				ext2_bloom_set(db, de->name, de->name_len);
+		}
+		ext2_put_page(page);
+	}
+	if (db->db_entries > db->db_capacity)
+		goto fail;
+	ext2_bloom_install(dir, db);
+	return;
+fail:
+	ext2_bloom_release(dir->i_sb, db);
+}
+
+/*
+ * ext3301: readdir-plus.
+ *
+ * Entries are collected from the cookie onwards exactly as ext2_readdir()
+ * would return them.  Once the batch is complete the directory is
+ * unlocked and reads for every inode table block the batch refers to are
+ * started in ascending disk order, so a cold directory costs one sweep
+ * over the inode table rather than one seek per child.
+ */
+#define EXT2_RDP_BATCH		32
+
+static int ext2_cmp_fsblk(const void *a, const void *b)
+{
+	ext2_fsblk_t x = *(const ext2_fsblk_t *)a;
+	ext2_fsblk_t y = *(const ext2_fsblk_t *)b;
+
+	if (x < y)
+		return -1;
+	return x > y;
+}
+
+static void ext2_rdp_readahead(struct super_block *sb,
+			       struct ext2_dirent_plus *ents, unsigned count)
+{
+	ext2_fsblk_t blocks[EXT2_RDP_BATCH];
+	unsigned long offset, ino;
+	struct blk_plug plug;
+	unsigned i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		/*
+		 * A corrupt entry is for ext2_iget() to report, don't let
+		 * ext2_get_group_desc() complain about it first.
+		 */
+		ino = ents[i].dp_ino;
+		if ((ino != EXT2_ROOT_INO && ino < EXT2_FIRST_INO(sb)) ||
+		    ino > le32_to_cpu(EXT2_SB(sb)->s_es->s_inodes_count))
+			continue;
+		blocks[n] = ext2_inode_loc(sb, ino, &offset);
+		if (blocks[n])
+			n++;
+	}
+	sort(blocks, n, sizeof(blocks[0]), ext2_cmp_fsblk, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++)
+		if (i == 0 || blocks[i] != blocks[i - 1])
+			sb_breadahead(sb, blocks[i]);
+	blk_finish_plug(&plug);
+}
+
+int ext2_readdir_plus(struct file *filp, struct ext2_readdirplus __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	unsigned chunk_mask = ~(ext2_chunk_size(inode)-1);
+	unsigned char *types = NULL;
+	struct ext2_readdirplus rdp;
+	struct ext2_dirent_plus *ents;
+	unsigned long n, npages;
+	unsigned int offset, count = 0, i;
+	loff_t pos;
+	int err = 0;
+
+	if (copy_from_user(&rdp, arg, sizeof(rdp)))
+		return -EFAULT;
+	if (!rdp.rdp_count)
+		return -EINVAL;
+	if (rdp.rdp_count > EXT2_RDP_BATCH)
+		rdp.rdp_count = EXT2_RDP_BATCH;
+
+	ents = kcalloc(rdp.rdp_count, sizeof(*ents), GFP_KERNEL);
+	if (!ents)
+		return -ENOMEM;
+
+	if (EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_FILETYPE))
+		types = ext2_filetype_table;
+
+	mutex_lock(&inode->i_mutex);
+	pos = rdp.rdp_cookie;
+	npages = dir_pages(inode);
+	rdp.rdp_flags = 0;
+	if (pos > inode->i_size - EXT2_DIR_REC_LEN(1)) {
+		rdp.rdp_flags |= EXT2_RDP_EOF;
+		goto unlock;
+	}
+
+	n = pos >> PAGE_CACHE_SHIFT;
+	offset = pos & ~PAGE_CACHE_MASK;
+	for ( ; n < npages; n++, offset = 0) {
+		char *kaddr, *limit;
+		ext2_dirent *de;
+		struct page *page = ext2_get_page(inode, n, 0);
+
+		if (IS_ERR(page)) {
+			ext2_error(sb, __func__, "bad page in #%lu",
+				   inode->i_ino);
+			err = PTR_ERR(page);
+			goto unlock;
+		}
+		kaddr = page_address(page);
+		/* The cookie may predate changes to the directory */
+		if (offset)
+			offset = ext2_validate_entry(kaddr, offset, chunk_mask);
+		pos = ((loff_t)n << PAGE_CACHE_SHIFT) + offset;
+		de = (ext2_dirent *)(kaddr+offset);
+		limit = kaddr + ext2_last_byte(inode, n) - EXT2_DIR_REC_LEN(1);
+		for ( ;(char*)de <= limit; de = ext2_next_entry(de)) {
+			if (de->rec_len == 0) {
+				ext2_error(sb, __func__,
+					"zero-length directory entry");
+				ext2_put_page(page);
+				err = -EIO;
+				goto unlock;
+			}
+			if (de->inode && count == rdp.rdp_count)
+				break;
+			pos += ext2_rec_len_from_disk(de->rec_len);
+			if (de->inode) {
+				struct ext2_dirent_plus *dp = &ents[count++];
+
+				dp->dp_ino = le32_to_cpu(de->inode);
+				dp->dp_off = pos;
+				dp->dp_type = DT_UNKNOWN;
+				if (types && de->file_type < EXT2_FT_MAX)
+					dp->dp_type = types[de->file_type];
+				dp->dp_name_len = de->name_len;
+				memcpy(dp->dp_name, de->name, de->name_len);
+			}
+		}
+		ext2_put_page(page);
+		if ((char *)de <= limit)
+			break;
+	}
+	if (n >= npages)
+		rdp.rdp_flags |= EXT2_RDP_EOF;
+unlock:
+	mutex_unlock(&inode->i_mutex);
+	if (err)
+		goto out;
+
+	ext2_rdp_readahead(sb, ents, count);
+	for (i = 0; i < count; i++)
+		ext2_fill_dirent_plus(sb, &ents[i]);
+
+	rdp.rdp_cookie = pos;
+	rdp.rdp_count = count;
+	if (copy_to_user((void __user *)(unsigned long)rdp.rdp_buf, ents,
+			 count * sizeof(*ents)) ||
+	    copy_to_user(arg, &rdp, sizeof(rdp)))
+		err = -EFAULT;
+	file_accessed(filp);
+out:
+	kfree(ents);
+	return err;
+}
+
 /*
  *	ext2_find_entry()
  *
@@ -373,12 +799,14 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode * dir,
 	const char *name = child->name;
 	int namelen = child->len;
 	unsigned reclen = EXT2_DIR_REC_LEN(namelen);
+	struct ext2_match_key key;
 	unsigned long start, n;
 	unsigned long npages = dir_pages(dir);
 	struct page *page = NULL;
 	struct ext2_inode_info *ei = EXT2_I(dir);
 	ext2_dirent * de;
 	int dir_has_error = 0;
+	int bloom;
 
 	if (npages == 0)
 		goto out;
@@ -386,6 +814,11 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode * dir,
 	/* OFFSET_CACHE */
 	*res_page = NULL;
 
+	bloom = ext2_bloom_test(dir, name, namelen);
+	if (!bloom)
+		goto out;
+	ext2_match_key_init(&key, name, namelen);
+
 	start = ei->i_dir_start_lookup;
 	if (start >= npages)
 		start = 0;
@@ -404,7 +837,7 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode * dir,
 					ext2_put_page(page);
 					goto out;
 				}
-				if (ext2_match (namelen, name, de))
+				if (ext2_match(&key, de))
 					goto found;
 				de = ext2_next_entry(de);
 			}
@@ -423,6 +856,8 @@ struct ext2_dir_entry_2 *ext2_find_entry (struct inode * dir,
 			goto out;
 		}
 	} while (n != start);
+	if (!dir_has_error)
+		ext2_bloom_miss(dir, bloom);
 out:
 	return NULL;
 
@@ -496,6 +931,7 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	unsigned chunk_size = ext2_chunk_size(dir);
 	unsigned reclen = EXT2_DIR_REC_LEN(namelen);
 	unsigned short rec_len, name_len;
+	struct ext2_match_key key;
 	struct page *page = NULL;
 	ext2_dirent * de;
 	unsigned long npages = dir_pages(dir);
@@ -504,6 +940,8 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	loff_t pos;
 	int err;
 
+	ext2_match_key_init(&key, name, namelen);
+
 	/*
 	 * We take care of directory expansion in the same loop.
 	 * This code plays outside i_size, so it locks the page
@@ -537,7 +975,7 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 				goto out_unlock;
 			}
 			err = -EEXIST;
-			if (ext2_match (namelen, name, de))
+			if (ext2_match(&key, de))
 				goto out_unlock;
 			name_len = EXT2_DIR_REC_LEN(de->name_len);
 			rec_len = ext2_rec_len_from_disk(de->rec_len);
@@ -572,7 +1010,9 @@ got_it:
 	err = ext2_commit_chunk(page, pos, rec_len);
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 	EXT2_I(dir)->i_flags &= ~EXT2_BTREE_FL;
+	EXT2_I(dir)->i_dir_entries++;
 	mark_inode_dirty(dir);
+	ext2_bloom_add(dir, name, namelen);
 	/* OFFSET_CACHE */
 out_put:
 	ext2_put_page(page);
@@ -583,11 +1023,76 @@ out_unlock:
 	goto out_put;
 }
 
+/*
+ * ext3301: first live entry in the chunk at kaddr, or NULL if there is
+ * none.  The chunk must come from a checked page.
+ */
+static ext2_dirent *ext2_first_live(char *kaddr, unsigned chunk_size)
+{
+	ext2_dirent *de = (ext2_dirent *)kaddr;
+	char *end = kaddr + chunk_size;
+
+	while ((char *)de < end && de->rec_len) {
+		if (de->inode)
+			return de;
+		de = ext2_next_entry(de);
+	}
+	return NULL;
+}
+
+/*
+ * ext3301: a delete only trims the directory once at least
+ * EXT2_DIR_TRIM_MIN chunks, and 1/EXT2_DIR_TRIM_RATIO of it, sit empty at
+ * the tail, so that create/delete churn there doesn't free and allocate
+ * a block each time.  EXT2_IOC_COMPACTDIR trims whatever it can.
+ */
+#define EXT2_DIR_TRIM_MIN	2
+#define EXT2_DIR_TRIM_RATIO	4
+
+/*
+ * ext3301: directories used to keep every block they ever grew.  Hand
+ * back trailing chunks that no longer hold a live entry.  The first chunk
+ * (with "." and "..") is always kept.  With @lazy set nothing is handed
+ * back below the thresholds above.  Parent is locked.
+ */
+static void ext2_trim_dir(struct inode *dir, int lazy)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	loff_t size = dir->i_size;
+	loff_t empty;
+
+	while (size > chunk_size) {
+		loff_t pos = size - chunk_size;
+		struct page *page;
+		int dead;
+
+		page = ext2_get_page(dir, pos >> PAGE_CACHE_SHIFT, 0);
+		if (IS_ERR(page))
+			break;
+		dead = !ext2_first_live((char *)page_address(page) +
+					(pos & ~PAGE_CACHE_MASK), chunk_size);
+		ext2_put_page(page);
+		if (!dead)
+			break;
+		size = pos;
+	}
+	empty = (dir->i_size - size) / chunk_size;
+	if (lazy && (empty < EXT2_DIR_TRIM_MIN ||
+		     empty * EXT2_DIR_TRIM_RATIO < dir->i_size / chunk_size))
+		return;
+	if (size < dir->i_size)
+		ext2_shrink_dir(dir, size);
+}
+
 /*
  * ext2_delete_entry deletes a directory entry by merging it with the
  * previous entry. Page is up-to-date. Releases the page.
+ *
+ * ext3301: @moved says the name lives on elsewhere in the directory (see
+ * ext2_compact_dir), so the entry count is left alone.
  */
-int ext2_delete_entry (struct ext2_dir_entry_2 * dir, struct page * page )
+static int __ext2_delete_entry(struct ext2_dir_entry_2 *dir,
+			       struct page *page, int moved)
 {
 	struct inode *inode = page->mapping->host;
 	char *kaddr = page_address(page);
@@ -597,8 +1102,12 @@ int ext2_delete_entry (struct ext2_dir_entry_2 * dir, struct page * page )
 	loff_t pos;
 	ext2_dirent * pde = NULL;
 	ext2_dirent * de = (ext2_dirent *) (kaddr + from);
+	int in_tail;
 	int err;
 
+	in_tail = page_offset(page) + from + ext2_chunk_size(inode) >=
+							inode->i_size;
+
 	while ((char*)de < (char*)dir) {
 		if (de->rec_len == 0) {
 			ext2_error(inode->i_sb, __func__,
@@ -621,12 +1130,22 @@ int ext2_delete_entry (struct ext2_dir_entry_2 * dir, struct page * page )
 	err = ext2_commit_chunk(page, pos, to - from);
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
 	EXT2_I(inode)->i_flags &= ~EXT2_BTREE_FL;
+	if (!moved)
+		EXT2_I(inode)->i_dir_entries--;
 	mark_inode_dirty(inode);
 out:
 	ext2_put_page(page);
+	/* Emptying the last chunk lets the directory shrink */
+	if (!err && in_tail)
+		ext2_trim_dir(inode, 1);
 	return err;
 }
 
+int ext2_delete_entry (struct ext2_dir_entry_2 * dir, struct page * page )
+{
+	return __ext2_delete_entry(dir, page, 0);
+}
+
 /*
  * Set the first fragment of directory.
  */
@@ -663,11 +1182,88 @@ int ext2_make_empty(struct inode *inode, struct inode *parent)
 	ext2_set_de_type (de, inode);
 	kunmap_atomic(kaddr);
 	err = ext2_commit_chunk(page, 0, chunk_size);
+	if (!err) {
+		EXT2_I(inode)->i_dir_entries = 0;
+		EXT2_I(inode)->i_state |= EXT2_STATE_DIRCOUNT;
+	}
 fail:
 	page_cache_release(page);
 	return err;
 }
 
+/*
+ * ext3301: is this live entry "." or ".."?  Those never count as children.
+ */
+static inline int ext2_is_dot_entry(struct inode *dir, ext2_dirent *de)
+{
+	if (de->name[0] != '.' || de->name_len > 2)
+		return 0;
+	if (de->name_len == 1)
+		return de->inode == cpu_to_le32(dir->i_ino);
+	return de->name[1] == '.';
+}
+
+/*
+ * ext3301: count the live entries by walking the whole directory.  Fails
+ * rather than guess if any page is unreadable.
+ */
+static int ext2_scan_dir_count(struct inode *dir, __u32 *count)
+{
+	unsigned long i, npages = dir_pages(dir);
+	__u32 n = 0;
+
+	for (i = 0; i < npages; i++) {
+		struct page *page = ext2_get_page(dir, i, 0);
+		char *kaddr, *limit;
+		ext2_dirent *de;
+
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		kaddr = page_address(page);
+		de = (ext2_dirent *)kaddr;
+		limit = kaddr + ext2_last_byte(dir, i) - EXT2_DIR_REC_LEN(1);
+		while ((char *)de <= limit) {
+			if (de->rec_len == 0) {
+				ext2_error(dir->i_sb, __func__,
+					"zero-length directory entry");
+				ext2_put_page(page);
+				return -EIO;
+			}
+			if (de->inode && !ext2_is_dot_entry(dir, de))
+				n++;
+			de = ext2_next_entry(de);
+		}
+		ext2_put_page(page);
+	}
+	*count = n;
+	return 0;
+}
+
+/*
+ * ext3301: number of live entries in a directory, other than "." and "..".
+ * Kept up to date by ext2_add_link() and ext2_delete_entry(), and stored
+ * in the on-disk inode.  When no trusted count is around (an old
+ * directory, or one some other writer may have changed since, see
+ * ext2_dircount_setup()) one full scan rebuilds it.
+ * Caller holds i_mutex.
+ */
+int ext2_dir_count(struct inode *dir, __u32 *count)
+{
+	struct ext2_inode_info *ei = EXT2_I(dir);
+	int err;
+
+	if (!(ei->i_state & EXT2_STATE_DIRCOUNT)) {
+		err = ext2_scan_dir_count(dir, &ei->i_dir_entries);
+		if (err)
+			return err;
+		ei->i_state |= EXT2_STATE_DIRCOUNT;
+		if (!(dir->i_sb->s_flags & MS_RDONLY))
+			mark_inode_dirty(dir);
+	}
+	*count = ei->i_dir_entries;
+	return 0;
+}
+
 /*
  * routine to check that the specified directory is empty (for rmdir)
  */
@@ -676,6 +1272,11 @@ int ext2_empty_dir (struct inode * inode)
 	struct page *page = NULL;
 	unsigned long i, npages = dir_pages(inode);
 	int dir_has_error = 0;
+	__u32 count;
+
+	/* ext3301: fall back to the old, forgiving walk if the count fails */
+	if (!ext2_dir_count(inode, &count))
+		return count == 0;
 
 	for (i = 0; i < npages; i++) {
 		char *kaddr;
@@ -722,6 +1323,140 @@ not_empty:
 	return 0;
 }
 
+/*
+ * ext3301: copy an entry into free space below @limit, the same way
+ * ext2_add_link() fills a hole.  The copy is committed before the caller
+ * removes the original, so lookups never miss the name.
+ */
+static int ext2_move_entry_below(struct inode *dir, loff_t limit,
+				 const char *name, int namelen,
+				 __le32 ino, __u8 file_type)
+{
+	unsigned reclen = EXT2_DIR_REC_LEN(namelen);
+	unsigned long npages = (limit + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	unsigned short rec_len, name_len;
+	struct page *page = NULL;
+	ext2_dirent *de;
+	unsigned long n;
+	char *kaddr, *end;
+	loff_t pos;
+	int err;
+
+	for (n = 0; n < npages; n++) {
+		page = ext2_get_page(dir, n, 0);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		lock_page(page);
+		kaddr = page_address(page);
+		end = kaddr + min_t(loff_t, limit - page_offset(page),
+				    PAGE_CACHE_SIZE);
+		de = (ext2_dirent *)kaddr;
+		while ((char *)de < end) {
+			if (de->rec_len == 0) {
+				ext2_error(dir->i_sb, __func__,
+					"zero-length directory entry");
+				err = -EIO;
+				goto out_unlock;
+			}
+			name_len = EXT2_DIR_REC_LEN(de->name_len);
+			rec_len = ext2_rec_len_from_disk(de->rec_len);
+			if (!de->inode && rec_len >= reclen)
+				goto got_it;
+			if (de->inode && rec_len >= name_len + reclen)
+				goto got_it;
+			de = (ext2_dirent *) ((char *) de + rec_len);
+		}
+		unlock_page(page);
+		ext2_put_page(page);
+	}
+	return -ENOSPC;
+
+got_it:
+	pos = page_offset(page) + (char *)de - (char *)page_address(page);
+	err = ext2_prepare_chunk(page, pos, rec_len);
+	if (err)
+		goto out_unlock;
+	if (de->inode) {
+		ext2_dirent *de1 = (ext2_dirent *) ((char *) de + name_len);
+		de1->rec_len = ext2_rec_len_to_disk(rec_len - name_len);
+		de->rec_len = ext2_rec_len_to_disk(name_len);
+		de = de1;
+	}
+	de->name_len = namelen;
+	memcpy(de->name, name, namelen);
+	de->file_type = file_type;
+	de->inode = ino;
+	err = ext2_commit_chunk(page, pos, rec_len);
+	ext2_put_page(page);
+	return err;
+
+out_unlock:
+	unlock_page(page);
+	ext2_put_page(page);
+	return err;
+}
+
+/*
+ * ext3301: online directory compaction (EXT2_IOC_COMPACTDIR).
+ *
+ * Live entries are moved out of the last chunk into holes nearer the
+ * front, one at a time, until the tail can be truncated away.  We stop at
+ * the first entry that no longer fits anywhere earlier.  Parent is locked.
+ *
+ * Only the tail is worked on.  Entries are never slid together inside a
+ * chunk, so free space split over several small holes in one chunk
+ * cannot take a name longer than the largest of them, and compaction
+ * can end with the directory still larger than its live entries need.
+ * Running out of room is not an error: whatever was trimmed stays
+ * trimmed and 0 is returned.
+ *
+ * Every move is committed through ext2_commit_chunk(), which bumps
+ * i_version, so a reader's cookie is revalidated by ext2_validate_entry()
+ * and never lands in the middle of a record.  A cookie past the new end
+ * of the directory simply reads as EOF.  To a reader that is part way
+ * through the directory, a moved entry looks just like an entry renamed
+ * in place: it may be returned twice, or not at all.
+ */
+int ext2_compact_dir(struct inode *dir)
+{
+	unsigned chunk_size = ext2_chunk_size(dir);
+	char name[EXT2_NAME_LEN];
+	int err = 0;
+
+	while (dir->i_size > chunk_size) {
+		loff_t tail = dir->i_size - chunk_size;
+		struct page *page;
+		ext2_dirent *de;
+		int namelen;
+
+		page = ext2_get_page(dir, tail >> PAGE_CACHE_SHIFT, 0);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		de = ext2_first_live((char *)page_address(page) +
+				     (tail & ~PAGE_CACHE_MASK), chunk_size);
+		if (!de) {
+			ext2_put_page(page);
+			ext2_trim_dir(dir, 0);
+			if (dir->i_size > tail)
+				break;
+			continue;
+		}
+		namelen = de->name_len;
+		memcpy(name, de->name, namelen);
+		err = ext2_move_entry_below(dir, tail, name, namelen,
+					    de->inode, de->file_type);
+		if (err) {
+			ext2_put_page(page);
+			break;
+		}
+		/* Nothing else can touch the tail chunk while we hold i_mutex */
+		err = __ext2_delete_entry(de, page, 1);
+		if (err)
+			break;
+	}
+	return err == -ENOSPC ? 0 : err;
+}
+
 const struct file_operations ext2_dir_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
@@ -19,6 +19,9 @@
 #include <linux/blockgroup_lock.h>
 #include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
 
 /* XXX Here for now... not interested in restructing headers JUST now */
 
@@ -60,11 +63,43 @@ struct ext2_block_alloc_info {
 	 * allocation when we detect linearly ascending requests.
 	 */
 	ext2_fsblk_t		last_alloc_physical_block;
+	/*
+	 * ext3301: blocks appended in logical order since the file last
+	 * seeked, which drives the size of its reservation window.
+	 */
+	__u32			seq_alloc_blocks;
+	__u32			rsv_flags;
+	/*
+	 * ext3301: the group a streaming file is counted against, and where
+	 * its next sequential allocation should go instead of straight on
+	 * (0 = straight on).
+	 */
+	__u32			stream_group;
+	ext2_fsblk_t		stream_goal;
 };
 
+/* rsv_flags: window size was set with EXT2_IOC_SETRSVSZ, leave it be */
+#define EXT2_RSV_FIXED		0x0001
+/* rsv_flags: counted as a stream in s_group_streams[stream_group] */
+#define EXT2_RSV_STREAM		0x0002
+
 #define rsv_start rsv_window._rsv_start
 #define rsv_end rsv_window._rsv_end
 
+/*
+ * ext3301: the reservation windows are kept in one rb tree per shard, a
+ * shard being a run of 2^s_rsv_shard_bits block groups.  A window never
+ * reaches past rs_last_block, so it lives in the tree of the shard its
+ * start block falls in, and rs_lock is all that guards it.
+ */
+struct ext2_rsv_shard {
+	spinlock_t			rs_lock;
+	struct rb_root			rs_root;
+	ext2_fsblk_t			rs_last_block;
+	unsigned int			rs_windows;	/* not counting rs_head */
+	struct ext2_reserve_window_node	rs_head;
+};
+
 /*
  * second extended-fs super-block data in memory
  */
@@ -73,6 +108,8 @@ struct ext2_sb_info {
 	unsigned long s_frags_per_block;/* Number of fragments per block */
 	unsigned long s_inodes_per_block;/* Number of inodes per block */
 	unsigned long s_frags_per_group;/* Number of fragments in a group */
+	unsigned int s_log_groups_per_flex; /* ext3301: 0 without FLEX_BG */
+	u32 s_dircount_gen;		/* ext3301: stored dir counts to trust */
 	unsigned long s_blocks_per_group;/* Number of blocks in a group */
 	unsigned long s_inodes_per_group;/* Number of inodes in a group */
 	unsigned long s_itb_per_group;	/* Number of inode table blocks per group */
@@ -98,14 +135,82 @@ struct ext2_sb_info {
 	u32 s_next_generation;
 	unsigned long s_dir_count;
 	u8 *s_debts;
+	/* ext3301: summary tree over the group counters, see groups.c */
+	struct ext2_group_sum *s_group_tree;
+	unsigned int s_group_tree_size;
+	spinlock_t s_group_tree_lock;
 	struct percpu_counter s_freeblocks_counter;
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
+	/* ext3301: blocks reserved by delayed allocation, not yet allocated */
+	struct percpu_counter s_dirtyblocks_counter;
 	struct blockgroup_lock *s_blockgroup_lock;
-	/* root of the per fs reservation window tree */
-	spinlock_t s_rsv_window_lock;
-	struct rb_root s_rsv_window_root;
-	struct ext2_reserve_window_node s_rsv_window_head;
+	/* ext3301: reservation window trees, one per shard of groups */
+	struct ext2_rsv_shard *s_rsv_shards;
+	unsigned int s_rsv_shard_bits;
+	/* ext3301: streaming writers currently allocating in each group */
+	atomic_t *s_group_streams;
+	/* ext3301: block bitmaps pinned in memory, at most s_bitmap_pin */
+	struct ext2_bitmap_cache *s_bitmap_cache;
+	unsigned int s_bitmap_pin;
+	/*
+	 * ext3301: uninit_bg.  s_itable_sems[group] keeps inode allocation
+	 * out of a group whose table s_lazyinit_task is zeroing.
+	 */
+	struct rw_semaphore *s_itable_sems;
+	struct task_struct *s_lazyinit_task;
+	unsigned int s_li_wait_mult;
+	/* ext3301: inode table readahead window, a power of two or 0 */
+	unsigned long s_inode_readahead_blks;
+	/* ext3301: RAID geometry in blocks, from stride=/stripe_width= */
+	unsigned long s_stride;
+	unsigned long s_stripe_width;
+	/*
+	 * ext3301: directory bloom filters.  s_bloom_lock guards the memory
+	 * accounting; s_bloom_max is the bloom_mem= budget in bytes.
+	 */
+	spinlock_t s_bloom_lock;
+	unsigned long s_bloom_mem;
+	unsigned long s_bloom_max;
+	unsigned long s_bloom_filters;
+	atomic_long_t s_bloom_hits;
+	atomic_long_t s_bloom_false;
+	/*
+	 * ext3301: DIRSYNC group commit.  Updates queue on s_dirsync_list
+	 * (under s_dirsync_lock); the holder of s_dirsync_mutex writes them.
+	 */
+	spinlock_t s_dirsync_lock;
+	struct list_head s_dirsync_list;
+	struct mutex s_dirsync_mutex;
+	/*
+	 * ext3301: per group buddy summaries of the block bitmaps
+	 * (mballoc.c).  s_buddy_count are built; s_mb_shrinker frees them
+	 * again, round robin from s_mb_shrink_group.
+	 */
+	struct ext2_buddy **s_buddy;
+	atomic_t s_buddy_count;
+	unsigned int s_mb_shrink_group;
+	struct shrinker s_mb_shrinker;
+	/*
+	 * ext3301: -o discard.  Freed extents queue on s_discard_list (under
+	 * s_discard_lock) until s_discard_blocks reaches EXT2_DISCARD_BATCH,
+	 * then s_discard_work trims them.
+	 */
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;
+	unsigned long s_discard_blocks;
+	struct work_struct s_discard_work;
+	/*
+	 * ext3301: -o lazytime.  Inodes whose timestamps alone changed queue
+	 * on s_lazy_list (under s_lazy_lock), oldest first; s_lazy_work
+	 * writes them once they are s_lazytime_age seconds old.
+	 */
+	spinlock_t s_lazy_lock;
+	struct list_head s_lazy_list;
+	struct delayed_work s_lazy_work;
+	/* ext3301: back pointer for s_lazy_work and s_discard_work */
+	struct super_block *s_sb;
+	unsigned long s_lazytime_age;
 	/*
 	 * s_lock protects against concurrent modifications of s_mount_state,
 	 * s_blocks_last, s_overhead_last and the content of superblock's
@@ -134,7 +239,48 @@ sb_bgl_lock(struct ext2_sb_info *sbi, unsigned int block_group)
 #define EXT2_DEFAULT_RESERVE_BLOCKS     8
 /*max window size: 1024(direct blocks) + 3([t,d]indirect blocks) */
 #define EXT2_MAX_RESERVE_BLOCKS         1027
+/*
+ * ext3301: mballoc tracks free aligned runs of up to 2^(EXT2_MB_ORDERS-1)
+ * blocks, which covers the largest reservation window.
+ */
+#define EXT2_MB_ORDERS			11
+/* ext3301: summaries one goal search may build, see ext2_mb_find_goal() */
+#define EXT2_MB_BUILD_BUDGET		4
+
+/* ext3301: freed blocks queued up by -o discard before they are trimmed */
+#define EXT2_DISCARD_BATCH		2048
+
+/* ext3301: upper bound on the number of reservation window trees */
+#define EXT2_RSV_MAX_SHARDS		256
+
+/* ext3301: blocks appended in order before a file counts as a stream */
+#define EXT2_STREAM_BLOCKS		256
+/* ext3301: slots per group that streams sharing a group are spread over */
+#define EXT2_STREAM_SLOTS		8
+/* ext3301: idle groups a new stream looks at before it settles */
+#define EXT2_STREAM_PROBES		8
+
+/* ext3301: cap on the adaptive window of a growing directory */
+#define EXT2_MAX_DIR_RESERVE_BLOCKS     128
 #define EXT2_RESERVE_WINDOW_NOT_ALLOCATED 0
+
+/*
+ * ext3301: default memory budget for directory bloom filters, in KB
+ */
+#define EXT2_DEF_BLOOM_MEM		4096
+/*
+ * ext3301: the lazyinit thread sleeps this many times as long as zeroing
+ * the last inode table took, to leave the disk mostly to everyone else
+ */
+#define EXT2_DEF_LI_WAIT_MULT		10
+/*
+ * ext3301: inode table blocks read around each one missed, by default
+ */
+#define EXT2_DEF_INODE_READAHEAD_BLKS	32
+/*
+ * ext3301: longest a lazytime timestamp update stays in memory, in seconds
+ */
+#define EXT2_DEF_LAZYTIME_AGE		(12 * 60 * 60)
 /*
  * The second extended file system version
  */
@@ -203,10 +349,20 @@ struct ext2_group_desc
 	__le16	bg_free_blocks_count;	/* Free blocks count */
 	__le16	bg_free_inodes_count;	/* Free inodes count */
 	__le16	bg_used_dirs_count;	/* Directories count */
-	__le16	bg_pad;
-	__le32	bg_reserved[3];
+	/* ext3301: as in ext4; only used with RO_COMPAT_GDT_CSUM */
+	__le16	bg_flags;		/* EXT2_BG_* */
+	__le32	bg_exclude_bitmap_lo;	/* Unused */
+	__le16	bg_block_bitmap_csum_lo;/* Unused */
+	__le16	bg_inode_bitmap_csum_lo;/* Unused */
+	__le16	bg_itable_unused;	/* Never used inodes at the table end */
+	__le16	bg_checksum;		/* crc16(s_uuid+group+desc) */
 };
 
+/* ext3301: bg_flags */
+#define EXT2_BG_INODE_UNINIT	0x0001	/* Inode table/bitmap not in use */
+#define EXT2_BG_BLOCK_UNINIT	0x0002	/* Block bitmap not in use */
+#define EXT2_BG_INODE_ZEROED	0x0004	/* On-disk itable initialized to zero */
+
 /*
  * Macro-instructions used to manage group descriptors
  */
@@ -286,6 +442,70 @@ static inline __u32 ext2_mask_flags(umode_t mode, __u32 flags)
 #define	EXT2_IOC_SETVERSION		FS_IOC_SETVERSION
 #define	EXT2_IOC_GETRSVSZ		_IOR('f', 5, long)
 #define	EXT2_IOC_SETRSVSZ		_IOW('f', 6, long)
+#define	EXT2_IOC_READDIRPLUS		_IOWR('f', 32, struct ext2_readdirplus)
+#define	EXT2_IOC_COMPACTDIR		_IO('f', 33)
+#define	EXT2_IOC_GETBLOOMSTATS		_IOR('f', 34, struct ext2_bloom_stats)
+#define	EXT2_IOC_GETDIRCOUNT		_IOR('f', 35, __u32)
+#define	EXT2_IOC_GETFRAG		_IOR('f', 36, struct ext2_frag_stats)
+#define	EXT2_IOC_DEFRAG			_IOR('f', 37, struct ext2_frag_stats)
+
+/*
+ * ext3301: readdir-plus (EXT2_IOC_READDIRPLUS).  One call returns a batch
+ * of directory entries together with the attributes of the inodes they
+ * name, so that "ls -l"-style scans need not stat() every child.  The
+ * layout is identical for 32 and 64 bit callers.
+ */
+struct ext2_dirent_plus {
+	__u64	dp_ino;			/* Inode number */
+	__u64	dp_off;			/* Cookie of the following entry */
+	__u64	dp_size;		/* Size in bytes */
+	__u64	dp_blocks;		/* 512-byte sectors allocated */
+	__s64	dp_atime;
+	__s64	dp_mtime;
+	__s64	dp_ctime;
+	__u32	dp_mode;		/* 0 if the inode could not be read */
+	__u32	dp_nlink;
+	__u32	dp_uid;
+	__u32	dp_gid;
+	__u8	dp_type;		/* DT_* as returned by readdir */
+	__u8	dp_name_len;
+	__u16	dp_pad;
+	char	dp_name[EXT2_NAME_LEN + 1];	/* NUL terminated */
+	__u32	dp_reserved;
+};
+
+struct ext2_readdirplus {
+	__u64	rdp_cookie;		/* in: where to resume, out: next cookie */
+	__u64	rdp_buf;		/* struct ext2_dirent_plus[rdp_count] */
+	__u32	rdp_count;		/* in: room in rdp_buf, out: filled */
+	__u32	rdp_flags;		/* out: EXT2_RDP_* */
+};
+
+#define EXT2_RDP_EOF			0x0001	/* End of directory reached */
+
+/*
+ * ext3301: directory bloom filter statistics (EXT2_IOC_GETBLOOMSTATS),
+ * filesystem wide.
+ */
+struct ext2_bloom_stats {
+	__u64	bs_hits;		/* misses answered without a scan */
+	__u64	bs_false_positives;	/* filter said maybe, scan found nothing */
+	__u64	bs_filters;		/* filters currently built */
+	__u64	bs_mem_used;		/* bytes */
+	__u64	bs_mem_max;		/* bytes, from bloom_mem= */
+};
+
+/*
+ * ext3301: physical layout of a file or directory (EXT2_IOC_GETFRAG, and
+ * the result of EXT2_IOC_DEFRAG).  A perfectly laid out file has
+ * fr_extents == 1; indirect blocks sit in between data blocks, so larger
+ * files always show a few more.
+ */
+struct ext2_frag_stats {
+	__u64	fr_blocks;		/* data blocks mapped below i_size */
+	__u64	fr_extents;		/* physically contiguous runs of them */
+	__u64	fr_holes;		/* unmapped ranges below i_size */
+};
 
 /*
  * ioctl commands in 32 bit emulation
@@ -333,7 +553,7 @@ struct ext2_inode {
 			__u16	i_pad1;
 			__le16	l_i_uid_high;	/* these 2 fields    */
 			__le16	l_i_gid_high;	/* were reserved2[0] */
-			__u32	l_i_reserved2;
+			__le32	l_i_reserved2;
 		} linux2;
 		struct {
 			__u8	h_i_frag;	/* Fragment number */
@@ -363,6 +583,18 @@ struct ext2_inode {
 #define i_gid_high	osd2.linux2.l_i_gid_high
 #define i_reserved2	osd2.linux2.l_i_reserved2
 
+/*
+ * ext3301: directories keep their live entry count + 1 here, 0 = unknown,
+ * valid only if stamped with the current s_dircount_gen
+ */
+#define i_dir_count	i_reserved2
+#define i_dir_count_gen	i_reserved1
+/*
+ * ext3301: regular files keep their init watermark + 1 here, 0 = none,
+ * with RO_COMPAT_INIT_MARK only
+ */
+#define i_init_mark	i_reserved1
+
 /*
  * File system states
  */
@@ -388,6 +620,11 @@ struct ext2_inode {
 #define EXT2_MOUNT_USRQUOTA		0x020000  /* user quota */
 #define EXT2_MOUNT_GRPQUOTA		0x040000  /* group quota */
 #define EXT2_MOUNT_RESERVATION		0x080000  /* Preallocation */
+#define EXT2_MOUNT_MBALLOC		0x100000  /* Buddy-guided allocation */
+#define EXT2_MOUNT_DELALLOC		0x200000  /* Delayed block allocation */
+#define EXT2_MOUNT_DISCARD		0x400000  /* Discard freed blocks */
+#define EXT2_MOUNT_NOINIT_ITABLE	0x800000  /* No lazy itable zeroing */
+#define EXT2_MOUNT_LAZYTIME		0x1000000 /* Timestamps kept in memory */
 
 
 #define clear_opt(o, opt)		o &= ~EXT2_MOUNT_##opt
@@ -466,7 +703,7 @@ struct ext2_super_block {
 	 */
 	__u8	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	__u8	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
-	__u16	s_padding1;
+	__le16	s_reserved_gdt_blocks;	/* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -480,7 +717,31 @@ struct ext2_super_block {
 	__u16	s_reserved_word_pad;
 	__le32	s_default_mount_opts;
  	__le32	s_first_meta_bg; 	/* First metablock block group */
-	__u32	s_reserved[190];	/* Padding to the end of the block */
+	/*
+	 * ext3301: named as in the ext3/ext4 layout, so the RAID geometry
+	 * that mke2fs -E stride=,stripe_width= records can be read.
+	 */
+	__le32	s_mkfs_time;		/* When the filesystem was created */
+	__le32	s_jnl_blocks[17];	/* Backup of the journal inode */
+	__le32	s_blocks_count_hi;	/* Blocks count, high 32 bits */
+	__le32	s_r_blocks_count_hi;	/* Reserved blocks count, high 32 bits */
+	__le32	s_free_blocks_hi;	/* Free blocks count, high 32 bits */
+	__le16	s_min_extra_isize;	/* All inodes have at least # bytes */
+	__le16	s_want_extra_isize;	/* New inodes should reserve # bytes */
+	__le32	s_flags;		/* Miscellaneous flags */
+	__le16	s_raid_stride;		/* RAID stride */
+	__le16	s_mmp_interval;		/* # seconds to wait in MMP checking */
+	__le64	s_mmp_block;		/* Block for multi-mount protection */
+	__le32	s_raid_stripe_width;	/* blocks on all data disks (N*stride) */
+	__u8	s_log_groups_per_flex;	/* FLEX_BG group size */
+	__u8	s_checksum_type;	/* Unused */
+	__u16	s_reserved_pad;
+	__u32	s_reserved[159];	/* Padding to the end of the block */
+	/* ext3301: directory entry count trust, see ext2_dircount_setup() */
+	__le32	s_dircount_gen;		/* Generation stamped on the counts */
+	__le16	s_dircount_mnt;		/* s_mnt_count as our last mount left it */
+	__u16	s_dircount_pad;
+	__u32	s_reserved2;		/* ext4's s_checksum */
 };
 
 /*
@@ -537,6 +798,15 @@ struct ext2_super_block {
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR	0x0004
+/* ext3301: uninit_bg, checksummed descriptors with lazily set up groups */
+#define EXT2_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
+/*
+ * ext3301: some regular file has an fallocate() init watermark in
+ * i_init_mark.  Other drivers and e2fsck would read the blocks past it
+ * back as data, stale disk contents, so they must not write (or check)
+ * the filesystem.  Set by the first fallocate().
+ */
+#define EXT2_FEATURE_RO_COMPAT_INIT_MARK	0x40000000
 #define EXT2_FEATURE_RO_COMPAT_ANY		0xffffffff
 
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION	0x0001
@@ -544,13 +814,22 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG		0x0010
+/*
+ * ext3301: the bitmaps and inode tables of each run of 2^s_log_groups_per_flex
+ * groups are packed together, normally at the start of the run's first
+ * group, instead of each group carrying its own.
+ */
+#define EXT2_FEATURE_INCOMPAT_FLEX_BG		0x0200
 #define EXT2_FEATURE_INCOMPAT_ANY		0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT2_FEATURE_INCOMPAT_SUPP	(EXT2_FEATURE_INCOMPAT_FILETYPE| \
-					 EXT2_FEATURE_INCOMPAT_META_BG)
+					 EXT2_FEATURE_INCOMPAT_META_BG| \
+					 EXT2_FEATURE_INCOMPAT_FLEX_BG)
 #define EXT2_FEATURE_RO_COMPAT_SUPP	(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT2_FEATURE_RO_COMPAT_LARGE_FILE| \
+					 EXT2_FEATURE_RO_COMPAT_GDT_CSUM| \
+					 EXT2_FEATURE_RO_COMPAT_INIT_MARK| \
 					 EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED	~EXT2_FEATURE_RO_COMPAT_SUPP
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED	~EXT2_FEATURE_INCOMPAT_SUPP
@@ -634,6 +913,11 @@ static inline void verify_offsets(void)
 	A(EXT2_SB_MAGIC_OFFSET, s_magic);
 	A(EXT2_SB_BLOCKS_OFFSET, s_blocks_count);
 	A(EXT2_SB_BSIZE_OFFSET, s_log_block_size);
+	A(0x164, s_raid_stride);
+	A(0x170, s_raid_stripe_width);
+	A(0x174, s_log_groups_per_flex);
+	A(0x3F4, s_dircount_gen);
+	BUILD_BUG_ON(sizeof(struct ext2_super_block) != 1024);
 #undef A
 }
 
@@ -673,6 +957,27 @@ struct ext2_inode_info {
 	struct ext2_block_alloc_info *i_block_alloc_info;
 
 	__u32	i_dir_start_lookup;
+
+	/*
+	 * ext3301: bloom filter over the names in a large directory.  The
+	 * pointer is swapped under i_meta_lock.
+	 */
+	struct ext2_dir_bloom *i_dir_bloom;
+
+	/*
+	 * ext3301: number of live entries in a directory, not counting "."
+	 * and "..".  Only meaningful while EXT2_STATE_DIRCOUNT is set, and
+	 * changed under the directory's i_mutex.
+	 */
+	__u32	i_dir_entries;
+
+	/*
+	 * ext3301: init watermark of a regular file.  Blocks at or past it
+	 * were preallocated by fallocate() and never written, so they read
+	 * back as holes.  EXT2_INIT_BLOCKS_ALL when there are none.  Changed
+	 * under truncate_mutex.
+	 */
+	__u32	i_init_blocks;
 #ifdef CONFIG_EXT2_FS_XATTR
 	/*
 	 * Extended attributes can be read independently of the main file
@@ -694,12 +999,23 @@ struct ext2_inode_info {
 	struct mutex truncate_mutex;
 	struct inode	vfs_inode;
 	struct list_head i_orphan;	/* unlinked but open inodes */
+
+	/*
+	 * ext3301: on s_lazy_list since jiffies i_lazy_since, with in-core
+	 * timestamps not yet in the inode table.
+	 */
+	struct list_head i_lazy_list;
+	unsigned long i_lazy_since;
 };
 
 /*
  * Inode dynamic state flags
  */
 #define EXT2_STATE_NEW			0x00000001 /* inode is newly created */
+#define EXT2_STATE_DIRCOUNT		0x00000002 /* i_dir_entries is valid */
+
+/* i_init_blocks of a file with no uninitialized blocks */
+#define EXT2_INIT_BLOCKS_ALL		(~0U)
 
 
 /*
@@ -722,6 +1038,10 @@ extern unsigned long ext2_bg_num_gdb(struct super_block *sb, int group);
 extern ext2_fsblk_t ext2_new_block(struct inode *, unsigned long, int *);
 extern ext2_fsblk_t ext2_new_blocks(struct inode *, unsigned long,
 				unsigned long *, int *);
+extern ext2_fsblk_t ext2_new_blocks_da(struct inode *, unsigned long,
+				unsigned long *, unsigned long, int *);
+extern ext2_fsblk_t ext2_find_free_run(struct super_block *, ext2_fsblk_t,
+				       unsigned long);
 extern void ext2_free_blocks (struct inode *, unsigned long,
 			      unsigned long);
 extern unsigned long ext2_count_free_blocks (struct super_block *);
@@ -730,10 +1050,24 @@ extern void ext2_check_blocks_bitmap (struct super_block *);
 extern struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 						    unsigned int block_group,
 						    struct buffer_head ** bh);
+extern __le16 ext2_group_desc_csum(struct super_block *, unsigned int,
+				    struct ext2_group_desc *);
+extern void ext2_group_desc_csum_set(struct super_block *, unsigned int,
+				     struct ext2_group_desc *);
+extern struct buffer_head *ext2_read_block_bitmap(struct super_block *,
+						  unsigned int);
+extern int ext2_has_free_blocks(struct ext2_sb_info *, s64);
 extern void ext2_discard_reservation (struct inode *);
 extern int ext2_should_retry_alloc(struct super_block *sb, int *retries);
 extern void ext2_init_block_alloc_info(struct inode *);
-extern void ext2_rsv_window_add(struct super_block *sb, struct ext2_reserve_window_node *rsv);
+extern void ext2_dir_rsv_goal(struct inode *);
+extern void ext2_rsv_tune(struct inode *, unsigned long, unsigned long);
+extern void ext2_stream_track(struct inode *);
+extern int ext2_trim_fs(struct super_block *, struct fstrim_range *);
+extern int ext2_discard_flush(struct super_block *);
+extern void ext2_discard_work(struct work_struct *);
+extern int ext2_rsv_init(struct super_block *);
+extern void ext2_rsv_release(struct super_block *);
 
 /* dir.c */
 extern int ext2_add_link (struct dentry *, struct inode *);
@@ -742,18 +1076,78 @@ extern int ext2_make_empty(struct inode *, struct inode *);
 extern struct ext2_dir_entry_2 * ext2_find_entry (struct inode *,struct qstr *, struct page **);
 extern int ext2_delete_entry (struct ext2_dir_entry_2 *, struct page *);
 extern int ext2_empty_dir (struct inode *);
+extern int ext2_dir_count(struct inode *, __u32 *);
 extern struct ext2_dir_entry_2 * ext2_dotdot (struct inode *, struct page **);
 extern void ext2_set_link(struct inode *, struct ext2_dir_entry_2 *, struct page *, struct inode *, int);
+extern int ext2_readdir_plus(struct file *, struct ext2_readdirplus __user *);
+extern int ext2_compact_dir(struct inode *);
+extern void ext2_dir_bloom_free(struct inode *);
 
 /* ialloc.c */
 extern struct inode * ext2_new_inode (struct inode *, umode_t, const struct qstr *);
 extern void ext2_free_inode (struct inode *);
 extern unsigned long ext2_count_free_inodes (struct super_block *);
 extern void ext2_check_inodes_bitmap (struct super_block *);
+extern struct buffer_head *ext2_read_inode_bitmap(struct super_block *,
+						  unsigned long);
+extern int ext2_init_inode_table(struct super_block *, unsigned int);
+
+/* bitmap.c */
+#ifdef EXT2FS_DEBUG
 extern unsigned long ext2_count_free (struct buffer_head *, unsigned);
+#endif
+extern ext2_grpblk_t ext2_find_zero_run(const void *, ext2_grpblk_t,
+					ext2_grpblk_t, ext2_grpblk_t);
+/*
+ * ext3301: BitmapChecked is set on a block bitmap buffer once
+ * ext2_valid_block_bitmap() has looked at it, BitmapInit once the bitmap
+ * of a BLOCK_UNINIT (or INODE_UNINIT) group has been built in it.  Both
+ * go away with the buffer.
+ */
+enum ext2_bh_state_bits {
+	BH_BitmapChecked = BH_PrivateStart,
+	BH_BitmapInit,
+};
+BUFFER_FNS(BitmapChecked, bitmap_checked)
+BUFFER_FNS(BitmapInit, bitmap_init)
+
+extern struct buffer_head *ext2_bitmap_cache_get(struct super_block *,
+						 unsigned int);
+extern void ext2_bitmap_cache_add(struct super_block *, unsigned int,
+				  struct buffer_head *);
+extern void ext2_bitmap_prefetch(struct super_block *, unsigned int);
+extern int ext2_bitmap_cache_init(struct super_block *);
+extern void ext2_bitmap_cache_release(struct super_block *);
+
+/* groups.c */
+/*
+ * ext3301: what ext2_group_search() looks for.  The bounds are inclusive;
+ * INT_MAX leaves an upper bound open.
+ */
+struct ext2_group_query {
+	int min_free_inodes;
+	int min_free_blocks;
+	int max_dirs;
+	int max_debt;
+};
+#define EXT2_GQ_FEWEST_DIRS		1
+#define EXT2_GQ_MOST_FREE_BLOCKS	2
+extern void ext2_group_sum_update(struct super_block *, unsigned int);
+extern int ext2_group_search(struct super_block *, unsigned int,
+			     struct ext2_group_query *, int);
+extern int ext2_groups_init(struct super_block *);
+extern void ext2_groups_release(struct super_block *);
 
 /* inode.c */
 extern struct inode *ext2_iget (struct super_block *, unsigned long);
+extern ext2_fsblk_t ext2_inode_loc(struct super_block *, ino_t, unsigned long *);
+extern int ext2_fill_dirent_plus(struct super_block *, struct ext2_dirent_plus *);
+extern void ext2_shrink_dir(struct inode *, loff_t);
+extern int ext2_dirsync_commit(struct inode *, struct page *);
+extern int ext2_update_time(struct inode *, struct timespec *, int);
+extern int ext2_lazytime_clear(struct inode *);
+extern void ext2_lazytime_flush(struct super_block *, int);
+extern void ext2_lazytime_work(struct work_struct *);
 extern int ext2_write_inode (struct inode *, struct writeback_control *);
 extern void ext2_evict_inode(struct inode *);
 extern int ext2_get_block(struct inode *, sector_t, struct buffer_head *, int);
@@ -762,11 +1156,22 @@ extern void ext2_set_inode_flags(struct inode *inode);
 extern void ext2_get_inode_flags(struct ext2_inode_info *);
 extern int ext2_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		       u64 start, u64 len);
+extern int ext2_get_frag(struct inode *, struct ext2_frag_stats *);
+extern long ext2_fallocate(struct file *, int, loff_t, loff_t);
+extern int ext2_defrag(struct inode *);
 
 /* ioctl.c */
 extern long ext2_ioctl(struct file *, unsigned int, unsigned long);
 extern long ext2_compat_ioctl(struct file *, unsigned int, unsigned long);
 
+/* mballoc.c */
+extern ext2_fsblk_t ext2_mb_find_goal(struct super_block *, ext2_fsblk_t,
+				      unsigned long);
+extern void ext2_mb_update(struct super_block *, unsigned int,
+			   struct buffer_head *, ext2_grpblk_t, unsigned long);
+extern int ext2_mb_init(struct super_block *);
+extern void ext2_mb_release(struct super_block *);
+
 /* namei.c */
 struct dentry *ext2_get_parent(struct dentry *child);
 
@@ -795,6 +1200,7 @@ extern const struct file_operations ext2_xip_file_operations;
 extern const struct address_space_operations ext2_aops;
 extern const struct address_space_operations ext2_aops_xip;
 extern const struct address_space_operations ext2_nobh_aops;
+extern const struct address_space_operations ext2_da_aops;
 
 /* namei.c */
 extern const struct inode_operations ext2_dir_inode_operations;
@@ -811,6 +1217,47 @@ ext2_group_first_block_no(struct super_block *sb, unsigned long group_no)
 		le32_to_cpu(EXT2_SB(sb)->s_es->s_first_data_block);
 }
 
+/*
+ * ext3301: the bg_flags of a group, which only mean something on an
+ * uninit_bg filesystem.
+ */
+static inline int ext2_has_group_desc_csum(struct super_block *sb)
+{
+	return EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_GDT_CSUM);
+}
+
+static inline unsigned int ext2_bg_flags(struct super_block *sb,
+					 struct ext2_group_desc *desc)
+{
+	return ext2_has_group_desc_csum(sb) ? le16_to_cpu(desc->bg_flags) : 0;
+}
+
+/*
+ * ext3301: does @block lie in @group?
+ */
+static inline int ext2_block_in_group(struct super_block *sb,
+				      ext2_fsblk_t block, unsigned long group)
+{
+	ext2_fsblk_t first = ext2_group_first_block_no(sb, group);
+
+	return block >= first && block - first < EXT2_BLOCKS_PER_GROUP(sb);
+}
+
+/*
+ * ext3301: the unit large allocations are aligned to, in blocks: a full
+ * RAID stripe if its width is known, else one chunk, else 0 for none.
+ * Nothing bigger than a group can be honoured.
+ */
+static inline unsigned long ext2_stripe(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long stripe = sbi->s_stripe_width ? : sbi->s_stride;
+
+	if (stripe < 2 || stripe > EXT2_BLOCKS_PER_GROUP(sb))
+		return 0;
+	return stripe;
+}
+
 /*
  * ext3301-specific
  */
@@ -910,3 +1357,4 @@ extern const char * crypter_dir;
 #define ext2_test_bit	test_bit_le
 #define ext2_find_first_zero_bit	find_first_zero_bit_le
 #define ext2_find_next_zero_bit		find_next_zero_bit_le
+#define ext2_find_next_bit		find_next_bit_le
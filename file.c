@@ -52,6 +52,9 @@ int ext2_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	struct super_block *sb = file->f_mapping->host->i_sb;
 	struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
 
+	/* ext3301: lazytime timestamps go out with the inode */
+	if (!datasync && ext2_lazytime_clear(file->f_mapping->host))
+		mark_inode_dirty_sync(file->f_mapping->host);
 	ret = generic_file_fsync(file, start, end, datasync);
 	if (ret == -EIO || test_and_clear_bit(AS_EIO, &mapping->flags)) {
 		/* We don't really know where the IO error happened... */
@@ -248,6 +251,14 @@ ssize_t ext3301_reg2im(struct file * filp) {
 	if (!data)
 		return -ENOMEM;
 
+	// The block is read straight off the device below, so write back the
+	// page cache first (under delalloc it may not even have a block yet)
+	err = filemap_write_and_wait(i->i_mapping);
+	if (err) {
+		kfree(data);
+		return err;
+	}
+
 	// Lock the inode
 	INODE_LOCK(i);
 
@@ -412,6 +423,28 @@ ssize_t ext3301_write(struct file * filp, char __user * buf, size_t len,
 
 // --------------------------------------------------------------------
 
+/*
+ * ext3301 fallocate: wrapper for ext2_fallocate.
+ *  modifications: immediate files have no blocks to preallocate into,
+ *  so they become regular files first.
+ */
+static long ext3301_fallocate(struct file * filp, int mode, loff_t offset,
+		loff_t len) {
+	struct inode * i = FILP_INODE(filp);
+	ssize_t ret;
+
+	if (I_ISIM(i)) {
+		dbg_im(KERN_DEBUG "- IM-->REG conversion (fallocate)\n");
+		ret = ext3301_im2reg(filp);
+		if (ret < 0)
+			return ret;
+	}
+
+	return ext2_fallocate(filp, mode, offset, len);
+}
+
+// --------------------------------------------------------------------
+
 /*
  * We have mostly NULL's here: the current defaults are ok for
  * the ext2 filesystem.
@@ -432,6 +465,7 @@ const struct file_operations ext2_file_operations = {
 	.fsync		= ext2_fsync,
 	.splice_read	= generic_file_splice_read,
 	.splice_write	= generic_file_splice_write,
+	.fallocate	= ext3301_fallocate,
 };
 
 #ifdef CONFIG_EXT2_FS_XIP
@@ -458,6 +492,7 @@ const struct inode_operations ext2_file_inode_operations = {
 	.removexattr	= generic_removexattr,
 #endif
 	.setattr	= ext2_setattr,
+	.update_time	= ext2_update_time,
 	.get_acl	= ext2_get_acl,
 	.fiemap		= ext2_fiemap,
 };
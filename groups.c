@@ -0,0 +1,189 @@
+/*
+ *  linux/fs/ext2/groups.c
+ *  Added to ext2 as part of the ext3301 improvements
+ *
+ *  In-memory summary of the group descriptors, for inode placement.
+ *  find_group_dir(), find_group_orlov() and find_group_other() used to
+ *  walk every descriptor on each mkdir; with this they walk a tree and
+ *  skip whole ranges of groups that can't qualify.
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include "ext2.h"
+
+/*
+ * The groups are the leaves of a complete binary tree kept in one array:
+ * node 1 is the root, node n has children 2n and 2n + 1, and group g is
+ * node size + g.  A leaf holds the group's counters; an inner node holds
+ * the largest free counts and the smallest directory count and debt
+ * found below it, so a search can tell when a subtree has nothing that
+ * could match.  Leaves past the last group have no free inodes and never
+ * match.
+ *
+ * Updates are serialized by s_group_tree_lock.  Searches don't take it:
+ * like the descriptor counters they replace, the result is a hint that
+ * ext2_new_inode() checks against the bitmap anyway.
+ */
+struct ext2_group_sum {
+	__u16	gs_free_inodes;		/* leaf: count; node: max below */
+	__u16	gs_free_blocks;		/* leaf: count; node: max below */
+	__u16	gs_dirs;		/* leaf: count; node: min below */
+	__u8	gs_debt;		/* leaf: s_debts[]; node: min below */
+	__u8	gs_pad;
+};
+
+static void ext2_group_sum_pull(struct ext2_group_sum *gt, unsigned int n)
+{
+	struct ext2_group_sum *l = &gt[2 * n], *r = &gt[2 * n + 1];
+
+	gt[n].gs_free_inodes = max(l->gs_free_inodes, r->gs_free_inodes);
+	gt[n].gs_free_blocks = max(l->gs_free_blocks, r->gs_free_blocks);
+	gt[n].gs_dirs = min(l->gs_dirs, r->gs_dirs);
+	gt[n].gs_debt = min(l->gs_debt, r->gs_debt);
+}
+
+static void ext2_group_sum_leaf(struct super_block *sb, unsigned int group,
+				struct ext2_group_sum *gs)
+{
+	struct ext2_group_desc *desc = ext2_get_group_desc(sb, group, NULL);
+
+	if (!desc) {
+		gs->gs_free_inodes = 0;
+		gs->gs_free_blocks = 0;
+		gs->gs_dirs = USHRT_MAX;
+		gs->gs_debt = 0xff;
+		return;
+	}
+	gs->gs_free_inodes = le16_to_cpu(desc->bg_free_inodes_count);
+	gs->gs_free_blocks = le16_to_cpu(desc->bg_free_blocks_count);
+	gs->gs_dirs = le16_to_cpu(desc->bg_used_dirs_count);
+	gs->gs_debt = EXT2_SB(sb)->s_debts[group];
+}
+
+/**
+ * ext2_group_sum_update()
+ * @sb:			superblock
+ * @group:		block group
+ *
+ * Pick up the group's current free inode, free block, directory and
+ * debt counts.  Call after changing any of them.
+ */
+void ext2_group_sum_update(struct super_block *sb, unsigned int group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_sum *gt = sbi->s_group_tree;
+	unsigned int n = sbi->s_group_tree_size + group;
+
+	spin_lock(&sbi->s_group_tree_lock);
+	ext2_group_sum_leaf(sb, group, &gt[n]);
+	for (n >>= 1; n; n >>= 1)
+		ext2_group_sum_pull(gt, n);
+	spin_unlock(&sbi->s_group_tree_lock);
+}
+
+static int ext2_group_sum_may_match(const struct ext2_group_sum *gs,
+				    const struct ext2_group_query *q)
+{
+	return gs->gs_free_inodes >= q->min_free_inodes &&
+	       gs->gs_free_blocks >= q->min_free_blocks &&
+	       gs->gs_dirs <= q->max_dirs &&
+	       gs->gs_debt <= q->max_debt;
+}
+
+/*
+ * Walk the groups of [lo, hi) under node @n, which covers [nlo, nhi), in
+ * order.  Returns the first match; with @mode set, carries on with @q
+ * tightened past each match instead, and returns the last one found.
+ */
+static int ext2_group_walk(struct ext2_group_sum *gt, unsigned int n,
+			   unsigned int nlo, unsigned int nhi,
+			   unsigned int lo, unsigned int hi,
+			   struct ext2_group_query *q, int mode)
+{
+	unsigned int mid;
+	int found, right;
+
+	if (hi <= nlo || nhi <= lo || !ext2_group_sum_may_match(&gt[n], q))
+		return -1;
+	if (nhi - nlo == 1) {
+		if (mode == EXT2_GQ_FEWEST_DIRS)
+			q->max_dirs = gt[n].gs_dirs - 1;
+		else if (mode == EXT2_GQ_MOST_FREE_BLOCKS)
+			q->min_free_blocks = gt[n].gs_free_blocks + 1;
+		return nlo;
+	}
+	mid = nlo + (nhi - nlo) / 2;
+	found = ext2_group_walk(gt, 2 * n, nlo, mid, lo, hi, q, mode);
+	if (found >= 0 && !mode)
+		return found;
+	right = ext2_group_walk(gt, 2 * n + 1, mid, nhi, lo, hi, q, mode);
+	return right >= 0 ? right : found;
+}
+
+/**
+ * ext2_group_search()
+ * @sb:			superblock
+ * @start:		group to start from
+ * @q:			what the group must have, updated as it goes
+ * @mode:		0, EXT2_GQ_FEWEST_DIRS or EXT2_GQ_MOST_FREE_BLOCKS
+ *
+ * Search the groups cyclically from @start for one matching @q.  With
+ * @mode 0 the first match is returned.  Otherwise the best match by the
+ * given key is returned, the first one in search order on a tie.  Only
+ * groups with a free inode are ever returned.  Returns -1 if nothing
+ * matches.
+ */
+int ext2_group_search(struct super_block *sb, unsigned int start,
+		      struct ext2_group_query *q, int mode)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned int size = sbi->s_group_tree_size;
+	unsigned int ngroups = sbi->s_groups_count;
+	int found, wrapped;
+
+	if (q->min_free_inodes < 1)
+		q->min_free_inodes = 1;
+	found = ext2_group_walk(sbi->s_group_tree, 1, 0, size,
+				start, ngroups, q, mode);
+	if (found >= 0 && !mode)
+		return found;
+	wrapped = ext2_group_walk(sbi->s_group_tree, 1, 0, size,
+				  0, start, q, mode);
+	return wrapped >= 0 ? wrapped : found;
+}
+
+int ext2_groups_init(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long ngroups = sbi->s_groups_count;
+	unsigned int size = roundup_pow_of_two(ngroups);
+	struct ext2_group_sum *gt;
+	unsigned int n;
+
+	gt = vzalloc(2 * size * sizeof(*gt));
+	if (!gt)
+		return -ENOMEM;
+	for (n = 0; n < size; n++) {
+		if (n < ngroups) {
+			ext2_group_sum_leaf(sb, n, &gt[size + n]);
+		} else {
+			gt[size + n].gs_dirs = USHRT_MAX;
+			gt[size + n].gs_debt = 0xff;
+		}
+	}
+	for (n = size - 1; n; n--)
+		ext2_group_sum_pull(gt, n);
+
+	spin_lock_init(&sbi->s_group_tree_lock);
+	sbi->s_group_tree_size = size;
+	sbi->s_group_tree = gt;
+	return 0;
+}
+
+void ext2_groups_release(struct super_block *sb)
+{
+	vfree(EXT2_SB(sb)->s_group_tree);
+	EXT2_SB(sb)->s_group_tree = NULL;
+}
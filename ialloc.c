@@ -17,6 +17,7 @@
 #include <linux/backing-dev.h>
 #include <linux/buffer_head.h>
 #include <linux/random.h>
+#include <linux/blkdev.h>
 #include "ext2.h"
 #include "xattr.h"
 #include "acl.h"
@@ -42,19 +43,40 @@
  *
  * Return buffer_head of bitmap on success or NULL.
  */
-static struct buffer_head *
-read_inode_bitmap(struct super_block * sb, unsigned long block_group)
+struct buffer_head *
+ext2_read_inode_bitmap(struct super_block * sb, unsigned long block_group)
 {
 	struct ext2_group_desc *desc;
 	struct buffer_head *bh = NULL;
+	unsigned long i;
 
 	desc = ext2_get_group_desc(sb, block_group, NULL);
 	if (!desc)
 		goto error_out;
 
-	bh = sb_bread(sb, le32_to_cpu(desc->bg_inode_bitmap));
+	/*
+	 * ext3301: an INODE_UNINIT group has no bitmap on disk yet, all of
+	 * its inodes are free.
+	 */
+	if (ext2_bg_flags(sb, desc) & EXT2_BG_INODE_UNINIT) {
+		bh = sb_getblk(sb, le32_to_cpu(desc->bg_inode_bitmap));
+		if (bh) {
+			lock_buffer(bh);
+			if (!buffer_bitmap_init(bh)) {
+				memset(bh->b_data, 0, sb->s_blocksize);
+				for (i = EXT2_INODES_PER_GROUP(sb);
+				     i < sb->s_blocksize * 8; i++)
+					ext2_set_bit(i, bh->b_data);
+				set_buffer_bitmap_init(bh);
+				set_buffer_uptodate(bh);
+			}
+			unlock_buffer(bh);
+		}
+	} else {
+		bh = sb_bread(sb, le32_to_cpu(desc->bg_inode_bitmap));
+	}
 	if (!bh)
-		ext2_error(sb, "read_inode_bitmap",
+		ext2_error(sb, "ext2_read_inode_bitmap",
 			    "Cannot read inode bitmap - "
 			    "block_group = %lu, inode_bitmap = %u",
 			    block_group, le32_to_cpu(desc->bg_inode_bitmap));
@@ -78,7 +100,9 @@ static void ext2_release_inode(struct super_block *sb, int group, int dir)
 	le16_add_cpu(&desc->bg_free_inodes_count, 1);
 	if (dir)
 		le16_add_cpu(&desc->bg_used_dirs_count, -1);
+	ext2_group_desc_csum_set(sb, group, desc);
 	spin_unlock(sb_bgl_lock(EXT2_SB(sb), group));
+	ext2_group_sum_update(sb, group);
 	if (dir)
 		percpu_counter_dec(&EXT2_SB(sb)->s_dirs_counter);
 	mark_buffer_dirty(bh);
@@ -132,7 +156,7 @@ void ext2_free_inode (struct inode * inode)
 	}
 	block_group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
 	bit = (ino - 1) % EXT2_INODES_PER_GROUP(sb);
-	bitmap_bh = read_inode_bitmap(sb, block_group);
+	bitmap_bh = ext2_read_inode_bitmap(sb, block_group);
 	if (!bitmap_bh)
 		return;
 
@@ -203,28 +227,17 @@ static void ext2_preread_inode(struct inode *inode)
  */
 static int find_group_dir(struct super_block *sb, struct inode *parent)
 {
-	int ngroups = EXT2_SB(sb)->s_groups_count;
-	int avefreei = ext2_count_free_inodes(sb) / ngroups;
-	struct ext2_group_desc *desc, *best_desc = NULL;
-	int group, best_group = -1;
-
-	for (group = 0; group < ngroups; group++) {
-		desc = ext2_get_group_desc (sb, group, NULL);
-		if (!desc || !desc->bg_free_inodes_count)
-			continue;
-		if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
-			continue;
-		if (!best_desc || 
-		    (le16_to_cpu(desc->bg_free_blocks_count) >
-		     le16_to_cpu(best_desc->bg_free_blocks_count))) {
-			best_group = group;
-			best_desc = desc;
-		}
-	}
-	if (!best_desc)
-		return -1;
-
-	return best_group;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_query q = {
+		.min_free_inodes = percpu_counter_read_positive(
+					&sbi->s_freeinodes_counter) /
+				   sbi->s_groups_count,
+		.min_free_blocks = 0,
+		.max_dirs = INT_MAX,
+		.max_debt = INT_MAX,
+	};
+
+	return ext2_group_search(sb, 0, &q, EXT2_GQ_MOST_FREE_BLOCKS);
 }
 
 /* 
@@ -269,8 +282,8 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 	int blocks_per_dir;
 	int ndirs;
 	int max_debt, max_dirs, min_blocks, min_inodes;
-	int group = -1, i;
-	struct ext2_group_desc *desc;
+	int group = -1;
+	struct ext2_group_query q;
 
 	freei = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
 	avefreei = freei / ngroups;
@@ -280,32 +293,16 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 
 	if ((parent == sb->s_root->d_inode) ||
 	    (EXT2_I(parent)->i_flags & EXT2_TOPDIR_FL)) {
-		struct ext2_group_desc *best_desc = NULL;
-		int best_ndir = inodes_per_group;
-		int best_group = -1;
-
 		get_random_bytes(&group, sizeof(group));
 		parent_group = (unsigned)group % ngroups;
-		for (i = 0; i < ngroups; i++) {
-			group = (parent_group + i) % ngroups;
-			desc = ext2_get_group_desc (sb, group, NULL);
-			if (!desc || !desc->bg_free_inodes_count)
-				continue;
-			if (le16_to_cpu(desc->bg_used_dirs_count) >= best_ndir)
-				continue;
-			if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
-				continue;
-			if (le16_to_cpu(desc->bg_free_blocks_count) < avefreeb)
-				continue;
-			best_group = group;
-			best_ndir = le16_to_cpu(desc->bg_used_dirs_count);
-			best_desc = desc;
-		}
-		if (best_group >= 0) {
-			desc = best_desc;
-			group = best_group;
+		q.min_free_inodes = avefreei;
+		q.min_free_blocks = avefreeb;
+		q.max_dirs = inodes_per_group - 1;
+		q.max_debt = INT_MAX;
+		group = ext2_group_search(sb, parent_group, &q,
+					  EXT2_GQ_FEWEST_DIRS);
+		if (group >= 0)
 			goto found;
-		}
 		goto fallback;
 	}
 
@@ -326,31 +323,22 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 	if (max_debt == 0)
 		max_debt = 1;
 
-	for (i = 0; i < ngroups; i++) {
-		group = (parent_group + i) % ngroups;
-		desc = ext2_get_group_desc (sb, group, NULL);
-		if (!desc || !desc->bg_free_inodes_count)
-			continue;
-		if (sbi->s_debts[group] >= max_debt)
-			continue;
-		if (le16_to_cpu(desc->bg_used_dirs_count) >= max_dirs)
-			continue;
-		if (le16_to_cpu(desc->bg_free_inodes_count) < min_inodes)
-			continue;
-		if (le16_to_cpu(desc->bg_free_blocks_count) < min_blocks)
-			continue;
+	q.min_free_inodes = min_inodes;
+	q.min_free_blocks = min_blocks;
+	q.max_dirs = max_dirs - 1;
+	q.max_debt = max_debt - 1;
+	group = ext2_group_search(sb, parent_group, &q, 0);
+	if (group >= 0)
 		goto found;
-	}
 
 fallback:
-	for (i = 0; i < ngroups; i++) {
-		group = (parent_group + i) % ngroups;
-		desc = ext2_get_group_desc (sb, group, NULL);
-		if (!desc || !desc->bg_free_inodes_count)
-			continue;
-		if (le16_to_cpu(desc->bg_free_inodes_count) >= avefreei)
-			goto found;
-	}
+	q.min_free_inodes = avefreei;
+	q.min_free_blocks = 0;
+	q.max_dirs = INT_MAX;
+	q.max_debt = INT_MAX;
+	group = ext2_group_search(sb, parent_group, &q, 0);
+	if (group >= 0)
+		goto found;
 
 	if (avefreei) {
 		/*
@@ -372,6 +360,7 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 	int parent_group = EXT2_I(parent)->i_block_group;
 	int ngroups = EXT2_SB(sb)->s_groups_count;
 	struct ext2_group_desc *desc;
+	struct ext2_group_query q;
 	int group, i;
 
 	/*
@@ -408,20 +397,25 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 			goto found;
 	}
 
+	/*
+	 * ext3301: the hash can miss; ask the group summary tree for the
+	 * next group from there that has both, without looking at every
+	 * descriptor on the way.
+	 */
+	q.min_free_inodes = 1;
+	q.min_free_blocks = 1;
+	q.max_dirs = INT_MAX;
+	q.max_debt = INT_MAX;
+	group = ext2_group_search(sb, group, &q, 0);
+	if (group >= 0)
+		goto found;
+
 	/*
 	 * That failed: try linear search for a free inode, even if that group
 	 * has no free blocks.
 	 */
-	group = parent_group;
-	for (i = 0; i < ngroups; i++) {
-		if (++group >= ngroups)
-			group = 0;
-		desc = ext2_get_group_desc (sb, group, NULL);
-		if (desc && le16_to_cpu(desc->bg_free_inodes_count))
-			goto found;
-	}
-
-	return -1;
+	q.min_free_blocks = 0;
+	return ext2_group_search(sb, (parent_group + 1) % ngroups, &q, 0);
 
 found:
 	return group;
@@ -440,6 +434,7 @@ struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 	struct ext2_super_block *es;
 	struct ext2_inode_info *ei;
 	struct ext2_sb_info *sbi;
+	struct rw_semaphore *itable_sem = NULL;
 	int err;
 
 	sb = dir->i_sb;
@@ -464,10 +459,20 @@ struct inode *ext2_new_inode(struct inode *dir, umode_t mode,
 	}
 
 	for (i = 0; i < sbi->s_groups_count; i++) {
+		/* ext3301: keep the lazyinit thread off the table we try */
+		if (itable_sem)
+			up_read(itable_sem);
+		itable_sem = NULL;
+		if (ext2_has_group_desc_csum(sb)) {
+			itable_sem = &sbi->s_itable_sems[group];
+			down_read(itable_sem);
+		}
 		gdp = ext2_get_group_desc(sb, group, &bh2);
 		brelse(bitmap_bh);
-		bitmap_bh = read_inode_bitmap(sb, group);
+		bitmap_bh = ext2_read_inode_bitmap(sb, group);
 		if (!bitmap_bh) {
+			if (itable_sem)
+				up_read(itable_sem);
 			err = -EIO;
 			goto fail;
 		}
@@ -507,6 +512,8 @@ repeat_in_this_group:
 	/*
 	 * Scanned all blockgroups.
 	 */
+	if (itable_sem)
+		up_read(itable_sem);
 	err = -ENOSPC;
 	goto fail;
 got:
@@ -521,6 +528,8 @@ got:
 			    "reserved inode or inode > inodes count - "
 			    "block_group = %d,inode=%lu", group,
 			    (unsigned long) ino);
+		if (itable_sem)
+			up_read(itable_sem);
 		err = -EIO;
 		goto fail;
 	}
@@ -539,7 +548,21 @@ got:
 		if (sbi->s_debts[group])
 			sbi->s_debts[group]--;
 	}
+	if (ext2_has_group_desc_csum(sb)) {
+		unsigned int used = ino - group * EXT2_INODES_PER_GROUP(sb);
+
+		/* ext3301: the bitmap goes to disk now, and the table grows */
+		gdp->bg_flags &= cpu_to_le16(~EXT2_BG_INODE_UNINIT);
+		if (EXT2_INODES_PER_GROUP(sb) - used <
+		    le16_to_cpu(gdp->bg_itable_unused))
+			gdp->bg_itable_unused =
+				cpu_to_le16(EXT2_INODES_PER_GROUP(sb) - used);
+		ext2_group_desc_csum_set(sb, group, gdp);
+	}
 	spin_unlock(sb_bgl_lock(sbi, group));
+	if (itable_sem)
+		up_read(itable_sem);
+	ext2_group_sum_update(sb, group);
 
 	mark_buffer_dirty(bh2);
 	if (test_opt(sb, GRPID)) {
@@ -564,6 +587,8 @@ got:
 	ei->i_block_alloc_info = NULL;
 	ei->i_block_group = group;
 	ei->i_dir_start_lookup = 0;
+	ei->i_dir_entries = 0;
+	ei->i_init_blocks = EXT2_INIT_BLOCKS_ALL;
 	ei->i_state = EXT2_STATE_NEW;
 	ext2_set_inode_flags(inode);
 	spin_lock(&sbi->s_next_gen_lock);
@@ -632,7 +657,7 @@ unsigned long ext2_count_free_inodes (struct super_block * sb)
 			continue;
 		desc_count += le16_to_cpu(desc->bg_free_inodes_count);
 		brelse(bitmap_bh);
-		bitmap_bh = read_inode_bitmap(sb, i);
+		bitmap_bh = ext2_read_inode_bitmap(sb, i);
 		if (!bitmap_bh)
 			continue;
 
@@ -673,3 +698,44 @@ unsigned long ext2_count_dirs (struct super_block * sb)
 	return count;
 }
 
+
+/**
+ * ext2_init_inode_table()
+ * @sb:			superblock
+ * @group:		block group
+ *
+ * ext3301: zero the never used tail of a group's inode table, which
+ * mke2fs may have left unwritten on an uninit_bg filesystem, and flag the
+ * group INODE_ZEROED.  Inode allocation in this group is held off
+ * meanwhile, so the tail can't shrink under us.
+ */
+int ext2_init_inode_table(struct super_block *sb, unsigned int group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_group_desc *gdp;
+	struct buffer_head *bh;
+	unsigned long used;
+	int err = 0;
+
+	gdp = ext2_get_group_desc(sb, group, &bh);
+	if (!gdp)
+		return -EIO;
+	if (ext2_bg_flags(sb, gdp) & EXT2_BG_INODE_ZEROED)
+		return 0;
+
+	down_write(&sbi->s_itable_sems[group]);
+	used = EXT2_INODES_PER_GROUP(sb) - le16_to_cpu(gdp->bg_itable_unused);
+	used = DIV_ROUND_UP(used * EXT2_INODE_SIZE(sb), sb->s_blocksize);
+	if (used < sbi->s_itb_per_group)
+		err = sb_issue_zeroout(sb, le32_to_cpu(gdp->bg_inode_table) + used,
+				       sbi->s_itb_per_group - used, GFP_NOFS);
+	if (!err) {
+		spin_lock(sb_bgl_lock(sbi, group));
+		gdp->bg_flags |= cpu_to_le16(EXT2_BG_INODE_ZEROED);
+		ext2_group_desc_csum_set(sb, group, gdp);
+		spin_unlock(sb_bgl_lock(sbi, group));
+		mark_buffer_dirty(bh);
+	}
+	up_write(&sbi->s_itable_sems[group]);
+	return err;
+}
@@ -34,6 +34,10 @@
 #include <linux/mpage.h>
 #include <linux/fiemap.h>
 #include <linux/namei.h>
+#include <linux/cred.h>
+#include <linux/blkdev.h>
+#include <linux/pagevec.h>
+#include <linux/falloc.h>
 #include "ext2.h"
 #include "acl.h"
 #include "xip.h"
@@ -82,6 +86,10 @@ void ext2_evict_inode(struct inode * inode)
 
 	truncate_inode_pages(&inode->i_data, 0);
 
+	/* ext3301: lazytime timestamps still only in memory */
+	if (ext2_lazytime_clear(inode) && !want_delete && !is_bad_inode(inode))
+		__ext2_write_inode(inode, 0);
+
 	if (want_delete) {
 		sb_start_intwrite(inode->i_sb);
 		/* set dtime */
@@ -103,6 +111,7 @@ void ext2_evict_inode(struct inode * inode)
 	EXT2_I(inode)->i_block_alloc_info = NULL;
 	if (unlikely(rsv))
 		kfree(rsv);
+	ext2_dir_bloom_free(inode);
 
 	if (want_delete) {
 		ext2_free_inode(inode);
@@ -339,6 +348,13 @@ static inline ext2_fsblk_t ext2_find_goal(struct inode *inode, long block,
 	 */
 	if (block_i && (block == block_i->last_alloc_logical_block + 1)
 		&& (block_i->last_alloc_physical_block != 0)) {
+		/* ext3301: a new stream moving away from the others */
+		if (block_i->stream_goal) {
+			ext2_fsblk_t goal = block_i->stream_goal;
+
+			block_i->stream_goal = 0;
+			return goal;
+		}
 		return block_i->last_alloc_physical_block + 1;
 	}
 
@@ -396,7 +412,7 @@ ext2_blks_to_allocate(Indirect * branch, int k, unsigned long blks,
  */
 static int ext2_alloc_blocks(struct inode *inode,
 			ext2_fsblk_t goal, int indirect_blks, int blks,
-			ext2_fsblk_t new_blocks[4], int *err)
+			ext2_fsblk_t new_blocks[4], int delalloc, int *err)
 {
 	int target, i;
 	unsigned long count = 0;
@@ -417,7 +433,12 @@ static int ext2_alloc_blocks(struct inode *inode,
 	while (1) {
 		count = target;
 		/* allocating blocks for indirect blocks and direct blocks */
-		current_block = ext2_new_blocks(inode,goal,&count,err);
+		if (delalloc)
+			/* ext3301: the direct blocks' quota is reserved */
+			current_block = ext2_new_blocks_da(inode, goal, &count,
+						indirect_blks - index, err);
+		else
+			current_block = ext2_new_blocks(inode,goal,&count,err);
 		if (*err)
 			goto failed_out;
 
@@ -474,7 +495,7 @@ failed_out:
 
 static int ext2_alloc_branch(struct inode *inode,
 			int indirect_blks, int *blks, ext2_fsblk_t goal,
-			int *offsets, Indirect *branch)
+			int *offsets, Indirect *branch, int delalloc)
 {
 	int blocksize = inode->i_sb->s_blocksize;
 	int i, n = 0;
@@ -485,7 +506,7 @@ static int ext2_alloc_branch(struct inode *inode,
 	ext2_fsblk_t current_block;
 
 	num = ext2_alloc_blocks(inode, goal, indirect_blks,
-				*blks, new_blocks, &err);
+				*blks, new_blocks, delalloc, &err);
 	if (err)
 		return err;
 
@@ -584,9 +605,11 @@ static void ext2_splice_branch(struct inode *inode,
 	 * allocation
 	 */
 	if (block_i) {
+		ext2_rsv_tune(inode, block, blks);
 		block_i->last_alloc_logical_block = block + blks - 1;
 		block_i->last_alloc_physical_block =
 				le32_to_cpu(where[num].key) + blks - 1;
+		ext2_stream_track(inode);
 	}
 
 	/* We are done with atomic stuff, now do the rest of housekeeping */
@@ -599,6 +622,88 @@ static void ext2_splice_branch(struct inode *inode,
 	mark_inode_dirty(inode);
 }
 
+/*
+ * ext3301: ext2_get_blocks() flags.  Callers outside this file only ever
+ * pass 0 or 1 (EXT2_GB_CREATE).
+ */
+#define EXT2_GB_CREATE		0x1	/* allocate missing blocks */
+#define EXT2_GB_PREALLOC	0x2	/* fallocate: leave new blocks uninitialized */
+#define EXT2_GB_RAW		0x4	/* look past the init watermark */
+#define EXT2_GB_DELALLOC	0x8	/* delalloc: data blocks' quota is reserved */
+
+static int ext2_get_blocks(struct inode *inode, sector_t iblock,
+			   unsigned long maxblocks,
+			   struct buffer_head *bh_result, int create);
+
+/*
+ * ext3301: zero whatever is allocated in logical blocks [from, to), so
+ * that the init watermark can be moved up to @to.  Holes stay holes.
+ * Called with truncate_mutex held.
+ */
+static int ext2_init_range(struct inode *inode, sector_t from, sector_t to)
+{
+	struct buffer_head map;
+	int n, err;
+
+	while (from < to) {
+		map.b_state = 0;
+		n = ext2_get_blocks(inode, from, to - from, &map, EXT2_GB_RAW);
+		if (n < 0)
+			return n;
+		if (n == 0) {
+			from++;
+			continue;
+		}
+		err = sb_issue_zeroout(inode->i_sb, map.b_blocknr, n, GFP_NOFS);
+		if (err)
+			return err;
+		from += n;
+	}
+	return 0;
+}
+
+/*
+ * ext3301: ext2_get_blocks() found @count blocks at @iblock, some of them
+ * past the init watermark.  A lookup only maps the initialized part, or
+ * reports a hole (-ENODATA) if there is none.  A write initializes the
+ * file up to @iblock and moves the watermark past the blocks it maps,
+ * returning 1 so they are handed out as new and the caller zeroes what
+ * it doesn't write.  Returns 0 to map the blocks as they are.
+ */
+static int ext2_uninit_found(struct inode *inode, sector_t iblock,
+			     int *count, int create)
+{
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	__u32 init = ACCESS_ONCE(ei->i_init_blocks);
+	int err = 0;
+
+	if (iblock < init) {
+		*count = init - iblock;
+		return 0;
+	}
+	if (!(create & EXT2_GB_CREATE))
+		return -ENODATA;
+	if (create & EXT2_GB_PREALLOC)
+		return 0;
+
+	mutex_lock(&ei->truncate_mutex);
+	init = ei->i_init_blocks;
+	if (iblock < init) {
+		/* somebody else got here first */
+		if (iblock + *count > init)
+			*count = init - iblock;
+	} else {
+		err = ext2_init_range(inode, init, iblock);
+		if (!err) {
+			ei->i_init_blocks = iblock + *count;
+			mark_inode_dirty(inode);
+			err = 1;
+		}
+	}
+	mutex_unlock(&ei->truncate_mutex);
+	return err;
+}
+
 /*
  * Allocation strategy is simple: if we have to allocate something, we will
  * have to go the whole way to leaf. So let's do it before attaching anything
@@ -667,11 +772,11 @@ static int ext2_get_blocks(struct inode *inode,
 				break;
 		}
 		if (err != -EAGAIN)
-			goto got_it;
+			goto found;
 	}
 
 	/* Next simple case - plain lookup or failed read of indirect block */
-	if (!create || err == -EIO)
+	if (!(create & EXT2_GB_CREATE) || err == -EIO)
 		goto cleanup;
 
 	mutex_lock(&ei->truncate_mutex);
@@ -699,16 +804,34 @@ static int ext2_get_blocks(struct inode *inode,
 			if (err)
 				goto cleanup;
 			clear_buffer_new(bh_result);
-			goto got_it;
+			goto found;
 		}
 	}
 
+	/*
+	 * ext3301: a write past the init watermark must not leave the
+	 * preallocated blocks below it to read back as whatever was on
+	 * disk before.
+	 */
+	if (!(create & EXT2_GB_PREALLOC) && iblock > ei->i_init_blocks) {
+		err = ext2_init_range(inode, ei->i_init_blocks, iblock);
+		if (err) {
+			mutex_unlock(&ei->truncate_mutex);
+			goto cleanup;
+		}
+		ei->i_init_blocks = iblock;
+	}
+
 	/*
 	 * Okay, we need to do block allocation.  Lazily initialize the block
 	 * allocation info here if necessary
 	*/
-	if (S_ISREG(inode->i_mode) && (!ei->i_block_alloc_info))
+	if ((S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) &&
+	    !ei->i_block_alloc_info)
 		ext2_init_block_alloc_info(inode);
+	/* ext3301: directories grow into a window sized for them */
+	if (S_ISDIR(inode->i_mode) && ei->i_block_alloc_info)
+		ext2_dir_rsv_goal(inode);
 
 	goal = ext2_find_goal(inode, iblock, partial);
 
@@ -724,7 +847,8 @@ static int ext2_get_blocks(struct inode *inode,
 	 * XXX ???? Block out ext2_truncate while we alter the tree
 	 */
 	err = ext2_alloc_branch(inode, indirect_blks, &count, goal,
-				offsets + (partial - chain), partial);
+				offsets + (partial - chain), partial,
+				create & EXT2_GB_DELALLOC);
 
 	if (err) {
 		mutex_unlock(&ei->truncate_mutex);
@@ -743,9 +867,46 @@ static int ext2_get_blocks(struct inode *inode,
 		}
 	}
 
+	if ((create & EXT2_GB_PREALLOC) && iblock < ei->i_init_blocks) {
+		/*
+		 * ext3301: preallocated below the watermark, so the blocks
+		 * have to read back as zeroes straight away.
+		 */
+		err = sb_issue_zeroout(inode->i_sb,
+			le32_to_cpu(chain[depth-1].key),
+			min_t(sector_t, count, ei->i_init_blocks - iblock),
+			GFP_NOFS);
+		if (err) {
+			mutex_unlock(&ei->truncate_mutex);
+			goto cleanup;
+		}
+	}
+
 	ext2_splice_branch(inode, iblock, partial, indirect_blks, count);
+	if (!(create & EXT2_GB_PREALLOC)) {
+		if (iblock + count > ei->i_init_blocks)
+			ei->i_init_blocks = iblock + count;
+		set_buffer_new(bh_result);
+	}
 	mutex_unlock(&ei->truncate_mutex);
-	set_buffer_new(bh_result);
+	goto got_it;
+found:
+	/* ext3301: blocks past the init watermark hold no data yet */
+	if (!(create & EXT2_GB_RAW) &&
+	    iblock + count > ACCESS_ONCE(ei->i_init_blocks)) {
+		int ret = ext2_uninit_found(inode, iblock, &count, create);
+
+		if (ret < 0) {
+			err = (ret == -ENODATA) ? 0 : ret;
+			partial = chain + depth - 1;
+			goto cleanup;
+		}
+		if (ret)
+			set_buffer_new(bh_result);
+	}
+	/* ext3301: nothing to claim, the delalloc reservation goes back */
+	if (create & EXT2_GB_DELALLOC)
+		dquot_release_reservation_block(inode, count);
 got_it:
 	map_bh(bh_result, inode->i_sb, le32_to_cpu(chain[depth-1].key));
 	if (count > blocks_to_boundary)
@@ -781,6 +942,417 @@ int ext2_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 				    ext2_get_block);
 }
 
+/*
+ * ext3301: walk the block map below i_size and count the physically
+ * contiguous runs the data is split into (EXT2_IOC_GETFRAG).  Caller
+ * holds i_mutex.
+ */
+int ext2_get_frag(struct inode *inode, struct ext2_frag_stats *fs)
+{
+	unsigned blkbits = inode->i_blkbits;
+	sector_t iblock = 0, last;
+	ext2_fsblk_t next = 0;
+	int in_hole = 0;
+
+	memset(fs, 0, sizeof(*fs));
+	last = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	while (iblock < last) {
+		struct buffer_head map;
+		unsigned long max = min_t(sector_t, last - iblock,
+					  EXT2_MAX_RESERVE_BLOCKS);
+		int ret;
+
+		map.b_state = 0;
+		map.b_size = max << blkbits;
+		ret = ext2_get_blocks(inode, iblock, max, &map, EXT2_GB_RAW);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			if (!in_hole)
+				fs->fr_holes++;
+			in_hole = 1;
+			iblock++;
+			continue;
+		}
+		in_hole = 0;
+		if (map.b_blocknr != next)
+			fs->fr_extents++;
+		next = map.b_blocknr + ret;
+		fs->fr_blocks += ret;
+		iblock += ret;
+		cond_resched();
+	}
+	return 0;
+}
+
+/**
+ * ext2_fallocate()
+ * @file:		file
+ * @mode:		0 or FALLOC_FL_KEEP_SIZE
+ * @offset:		start of the range, in bytes
+ * @len:		length of the range, in bytes
+ *
+ * ext3301: allocate real blocks for the range in big runs, straight
+ * through ext2_new_blocks() and ext2_alloc_branch(), without writing any
+ * data.  ext2 has no unwritten extents, so the file gets an init
+ * watermark instead: it starts at the end of the file, blocks from there
+ * on read back as holes, and writes move it up (zeroing any preallocated
+ * blocks they skip over).  Blocks preallocated below the watermark are
+ * zeroed on disk.
+ */
+long ext2_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	unsigned blkbits = inode->i_blkbits;
+	loff_t new_size = offset + len;
+	struct buffer_head map;
+	sector_t block, end;
+	int ret = 0;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
+	if (ext2_use_xip(inode->i_sb))
+		return -EOPNOTSUPP;
+
+	mutex_lock(&inode->i_mutex);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && new_size > i_size_read(inode)) {
+		ret = inode_newsize_ok(inode, new_size);
+		if (ret)
+			goto out;
+	}
+
+	/* The watermark must not go to disk without the feature flag */
+	if (!EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_INIT_MARK)) {
+		spin_lock(&EXT2_SB(sb)->s_lock);
+		ext2_update_dynamic_rev(sb);
+		EXT2_SET_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_INIT_MARK);
+		spin_unlock(&EXT2_SB(sb)->s_lock);
+		ext2_write_super(sb);
+	}
+
+	/* Nothing is allocated past EOF without a watermark, start it there */
+	mutex_lock(&ei->truncate_mutex);
+	if (ei->i_init_blocks == EXT2_INIT_BLOCKS_ALL) {
+		ei->i_init_blocks = (i_size_read(inode) + (1 << blkbits) - 1)
+					>> blkbits;
+		mark_inode_dirty(inode);
+	}
+	mutex_unlock(&ei->truncate_mutex);
+
+	block = offset >> blkbits;
+	end = (new_size + (1 << blkbits) - 1) >> blkbits;
+	while (block < end) {
+		map.b_state = 0;
+		ret = ext2_get_blocks(inode, block, end - block, &map,
+				      EXT2_GB_CREATE | EXT2_GB_PREALLOC);
+		if (ret <= 0)
+			break;
+		block += ret;
+		ret = 0;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	/* Whatever got allocated before an error stays, as with ext4 */
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		new_size = min_t(loff_t, new_size, (loff_t)block << blkbits);
+		if (new_size > i_size_read(inode))
+			i_size_write(inode, new_size);
+	}
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+out:
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+/*
+ * ext3301: online defragmentation (EXT2_IOC_DEFRAG).
+ *
+ * A file is moved a chunk at a time.  A chunk is up to EXT2_DEFRAG_CHUNK
+ * mapped blocks whose pointers all sit in the same leaf (i_data or one
+ * indirect block), so the move can be done as one pointer swap.  For
+ * each chunk:
+ *
+ *  - a free run is looked for in the bitmaps, from right after the
+ *    previous chunk's run on, and allocated with ext2_new_blocks();
+ *  - the pages over the chunk are read in and locked, which keeps
+ *    page faults and writeback out, and the data is copied to the new
+ *    run from the page cache and written synchronously;
+ *  - under truncate_mutex the leaf pointers are switched to the new run
+ *    and the page buffers remapped to it;
+ *  - the old blocks are freed.
+ *
+ * i_mutex (held by the caller) keeps out write(), truncate and direct
+ * I/O.  Readers of uptodate pages go on undisturbed; anything written
+ * through an mmap after the copy leaves the page dirty, and writeback
+ * then sends it to the new blocks.
+ */
+#define EXT2_DEFRAG_CHUNK	32
+
+/* The buffer of @page that holds file block @block */
+static struct buffer_head *ext2_page_buffer(struct page *page,
+					    unsigned bits, sector_t block)
+{
+	struct buffer_head *bh = page_buffers(page);
+	unsigned i;
+
+	for (i = block & ((1 << bits) - 1); i; i--)
+		bh = bh->b_this_page;
+	return bh;
+}
+
+static int ext2_defrag_chunk(struct inode *inode, sector_t iblock, int n,
+			     ext2_fsblk_t *goal)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	unsigned bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t index, first_index = iblock >> bits;
+	struct page *pages[EXT2_DEFRAG_CHUNK];
+	struct buffer_head *bhs[EXT2_DEFRAG_CHUNK];
+	ext2_fsblk_t old[EXT2_DEFRAG_CHUNK], new, start;
+	unsigned long count = n;
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	__le32 *p = NULL;
+	int npages = 0, nbhs = 0, depth, i;
+	int err = 0;
+
+	/*
+	 * Only allocate when a whole run is free, so that a chunk we can't
+	 * place doesn't charge and refund quota and dirty the inode.
+	 */
+	start = ext2_find_free_run(sb, *goal, n);
+	if (!start)
+		return 0;
+
+	/* ext2_new_blocks() may move our reservation window */
+	mutex_lock(&ei->truncate_mutex);
+	new = ext2_new_blocks(inode, start, &count, &err);
+	mutex_unlock(&ei->truncate_mutex);
+	if (!new)
+		return err;
+	if (count < n) {
+		/* the run went to somebody else meanwhile, leave this chunk */
+		ext2_free_blocks(inode, new, count);
+		return 0;
+	}
+
+	for (index = first_index; index <= (iblock + n - 1) >> bits; index++) {
+		struct page *page;
+
+		page = read_mapping_page(inode->i_mapping, index, NULL);
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			goto out;
+		}
+		lock_page(page);
+		wait_on_page_writeback(page);
+		if (page->mapping != inode->i_mapping || !PageUptodate(page)) {
+			unlock_page(page);
+			page_cache_release(page);
+			err = -EAGAIN;
+			goto out;
+		}
+		if (!page_has_buffers(page))
+			create_empty_buffers(page, sb->s_blocksize, 0);
+		pages[npages++] = page;
+	}
+
+	/* Copy, and get the copy on disk before the pointers move */
+	for (i = 0; i < n; i++) {
+		sector_t block = iblock + i;
+		struct buffer_head *bh;
+		char *kaddr;
+
+		bh = sb_getblk(sb, new + i);
+		if (!bh) {
+			err = -ENOMEM;
+			goto out;
+		}
+		bhs[nbhs++] = bh;
+		kaddr = kmap_atomic(pages[(block >> bits) - first_index]);
+		lock_buffer(bh);
+		memcpy(bh->b_data, kaddr + ((block & ((1 << bits) - 1)) <<
+					    inode->i_blkbits), sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		kunmap_atomic(kaddr);
+		mark_buffer_dirty(bh);
+	}
+	for (i = 0; i < n; i++)
+		write_dirty_buffer(bhs[i], WRITE_SYNC);
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+	}
+	if (err)
+		goto out;
+
+	mutex_lock(&ei->truncate_mutex);
+	depth = ext2_block_to_path(inode, iblock, offsets, NULL);
+	partial = ext2_get_branch(inode, depth, offsets, chain, &err);
+	if (partial) {
+		/* the chunk can't have lost blocks with i_mutex held */
+		if (!err)
+			err = -EAGAIN;
+	} else {
+		p = chain[depth - 1].p;
+		for (i = 0; i < n && !err; i++) {
+			old[i] = le32_to_cpu(p[i]);
+			if (!old[i])
+				err = -EAGAIN;
+		}
+		partial = chain + depth - 1;
+	}
+	if (!err) {
+		for (i = 0; i < n; i++) {
+			sector_t block = iblock + i;
+
+			p[i] = cpu_to_le32(new + i);
+			map_bh(ext2_page_buffer(pages[(block >> bits) -
+					first_index], bits, block), sb, new + i);
+		}
+		if (chain[depth - 1].bh)
+			mark_buffer_dirty_inode(chain[depth - 1].bh, inode);
+		else
+			mark_inode_dirty(inode);
+	}
+	mutex_unlock(&ei->truncate_mutex);
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	if (err)
+		goto out;
+
+	/* Free the old blocks a run at a time */
+	for (i = 0; i < n; ) {
+		int len = 1;
+
+		while (i + len < n && old[i + len] == old[i] + len)
+			len++;
+		ext2_free_blocks(inode, old[i], len);
+		i += len;
+	}
+	*goal = new + n;
+out:
+	/*
+	 * The file's pages now own the data; don't leave block device
+	 * copies of it around to go stale.
+	 */
+	for (i = 0; i < nbhs; i++) {
+		lock_buffer(bhs[i]);
+		clear_buffer_uptodate(bhs[i]);
+		unlock_buffer(bhs[i]);
+		brelse(bhs[i]);
+	}
+	for (i = 0; i < npages; i++) {
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+	if (err)
+		ext2_free_blocks(inode, new, n);
+	return err;
+}
+
+/**
+ * ext2_defrag()
+ * @inode:		regular file, with i_mutex held
+ *
+ * Move the file's data into as few contiguous runs as free space allows.
+ * Chunks that are contiguous and follow on from the previous chunk stay
+ * where they are.  Blocks past i_size or the init watermark aren't
+ * touched.
+ */
+int ext2_defrag(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned blkbits = inode->i_blkbits;
+	ext2_fsblk_t goal = 0;
+	sector_t iblock = 0, last;
+	int err;
+
+	if (ext2_use_xip(sb))
+		return -EOPNOTSUPP;
+	inode_dio_wait(inode);
+	err = filemap_write_and_wait(inode->i_mapping);
+	if (err)
+		return err;
+
+	last = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	if (last > EXT2_I(inode)->i_init_blocks)
+		last = EXT2_I(inode)->i_init_blocks;
+
+	while (iblock < last) {
+		struct buffer_head map;
+		ext2_fsblk_t start = 0, end = 0;
+		int offsets[4], boundary, max, n = 0, extents = 0, ret;
+		int depth, meta = 0, k;
+
+		depth = ext2_block_to_path(inode, iblock, offsets, &boundary);
+		if (!depth)
+			break;
+		/*
+		 * A chunk that starts a new indirect block normally follows
+		 * that block, and any new parents of it, on disk: count them
+		 * as part of a contiguous layout.
+		 */
+		for (k = depth - 1; k > 0 && !offsets[k]; k--)
+			meta++;
+		max = min_t(sector_t, last - iblock,
+			    min(EXT2_DEFRAG_CHUNK, boundary + 1));
+		while (n < max) {
+			map.b_state = 0;
+			ret = ext2_get_blocks(inode, iblock + n, max - n, &map,
+					      EXT2_GB_RAW);
+			if (ret < 0)
+				return ret;
+			if (ret == 0)
+				break;
+			if (!n)
+				start = map.b_blocknr;
+			if (map.b_blocknr != end)
+				extents++;
+			end = map.b_blocknr + ret;
+			n += ret;
+		}
+		if (!n) {
+			iblock++;
+			continue;
+		}
+
+		if (extents == 1 &&
+		    (!goal || start == goal || start == goal + meta)) {
+			goal = end;
+		} else {
+			if (!goal)
+				goal = ext2_group_first_block_no(sb,
+						EXT2_I(inode)->i_block_group);
+			err = ext2_defrag_chunk(inode, iblock, n, &goal);
+			if (err == -EAGAIN)
+				err = 0;
+			if (err)
+				return err;
+		}
+		iblock += n;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	return 0;
+}
+
 static int ext2_writepage(struct page *page, struct writeback_control *wbc)
 {
 	return block_write_full_page(page, ext2_get_block, wbc);
@@ -871,6 +1443,308 @@ ext2_writepages(struct address_space *mapping, struct writeback_control *wbc)
 	return mpage_writepages(mapping, wbc, ext2_get_block);
 }
 
+/*
+ * ext3301: delayed allocation (-o delalloc).
+ *
+ * write_begin doesn't allocate a block for a hole it fills in.  It only
+ * reserves one: the buffer is marked delayed and mapped to a fake block,
+ * and the block is counted in s_dirtyblocks_counter and reserved against
+ * quota.  Real blocks are picked at writeback.  ext2_da_writepages() first
+ * walks the dirty range and hands every run of delayed blocks to
+ * ext2_get_blocks() in one go, so ext2_new_blocks() sees the whole run.
+ * A delayed buffer the walk missed gets its block from
+ * __block_write_full_page() as usual.  One that truncate or unlink throws
+ * away only gives its reservation back, so short-lived files never touch
+ * the bitmaps.
+ *
+ * mpage_writepage() would happily submit the fake block numbers, so the
+ * page writes go through block_write_full_page() instead.
+ */
+#define EXT2_DA_BLOCK		((sector_t)~0ULL)
+#define EXT2_DA_BATCH		64	/* pages kept locked per walk step */
+
+static int ext2_da_reserve(struct inode *inode)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+	s64 dirty;
+	int ret;
+
+	ret = dquot_reserve_block(inode, 1);
+	if (ret)
+		return ret;
+	/* Leave room for the indirect blocks the data will need too */
+	dirty = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+	if (!ext2_has_free_blocks(sbi, 4 + dirty /
+				  EXT2_ADDR_PER_BLOCK(inode->i_sb))) {
+		dquot_release_reservation_block(inode, 1);
+		return -ENOSPC;
+	}
+	percpu_counter_inc(&sbi->s_dirtyblocks_counter);
+	return 0;
+}
+
+static void ext2_da_release(struct inode *inode, unsigned long nr)
+{
+	percpu_counter_sub(&EXT2_SB(inode->i_sb)->s_dirtyblocks_counter, nr);
+	dquot_release_reservation_block(inode, nr);
+}
+
+static int ext2_da_get_block_prep(struct inode *inode, sector_t iblock,
+				  struct buffer_head *bh_result, int create)
+{
+	int ret;
+
+	ret = ext2_get_blocks(inode, iblock, 1, bh_result, EXT2_GB_RAW);
+	if (ret < 0)
+		return ret;
+	if (ret > 0) {
+		/*
+		 * Allocated already, maybe by fallocate() past the init
+		 * watermark.  Nothing to reserve: take it over the way a
+		 * plain write would, initialized and handed out as new.
+		 */
+		if (iblock >= ACCESS_ONCE(EXT2_I(inode)->i_init_blocks))
+			ret = ext2_get_blocks(inode, iblock, 1, bh_result,
+					      EXT2_GB_CREATE);
+		return ret < 0 ? ret : 0;
+	}
+	ret = ext2_da_reserve(inode);
+	if (ret)
+		return ret;
+	map_bh(bh_result, inode->i_sb, EXT2_DA_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+static int ext2_da_get_block_write(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+	int ret;
+
+	if (!buffer_delay(bh_result))
+		return ext2_get_block(inode, iblock, bh_result, create);
+	/* The block has to count as free for ext2_new_blocks() to take it */
+	percpu_counter_dec(&sbi->s_dirtyblocks_counter);
+	ret = ext2_get_blocks(inode, iblock, 1, bh_result,
+			      EXT2_GB_CREATE | EXT2_GB_DELALLOC);
+	if (ret <= 0) {
+		percpu_counter_inc(&sbi->s_dirtyblocks_counter);
+		return ret ? ret : -EIO;
+	}
+	clear_buffer_delay(bh_result);
+	return 0;
+}
+
+/*
+ * Allocate blocks [start, start + len), all delayed and all in the locked
+ * pages, and point their buffers at the new blocks.  Their quota
+ * reservation is claimed by the allocation itself.
+ */
+static int ext2_da_map_run(struct inode *inode, struct page **pages, int nr,
+			   sector_t start, unsigned long len)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+	unsigned bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	struct buffer_head map;
+	int i, ret;
+
+	while (len) {
+		/* The run has to count as free for ext2_new_blocks() */
+		percpu_counter_sub(&sbi->s_dirtyblocks_counter, len);
+		map.b_state = 0;
+		map.b_size = len << inode->i_blkbits;
+		ret = ext2_get_blocks(inode, start, len, &map,
+				      EXT2_GB_CREATE | EXT2_GB_DELALLOC);
+		if (ret <= 0) {
+			percpu_counter_add(&sbi->s_dirtyblocks_counter, len);
+			return ret ? ret : -EIO;
+		}
+		if (ret < len)
+			percpu_counter_add(&sbi->s_dirtyblocks_counter,
+					   len - ret);
+
+		for (i = 0; i < nr; i++) {
+			struct buffer_head *head, *bh;
+			sector_t block = (sector_t)pages[i]->index << bits;
+
+			bh = head = page_buffers(pages[i]);
+			do {
+				if (buffer_delay(bh) && block >= start &&
+				    block < start + ret) {
+					clear_buffer_delay(bh);
+					map_bh(bh, inode->i_sb, map.b_blocknr +
+						(block - start));
+					unmap_underlying_metadata(bh->b_bdev,
+								  bh->b_blocknr);
+				}
+				block++;
+			} while ((bh = bh->b_this_page) != head);
+		}
+		start += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void ext2_da_unlock_pages(struct page **pages, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+}
+
+/*
+ * Give every run of delayed blocks in dirty pages [index, end] its real
+ * blocks.  Pages are kept locked from the time their buffers are looked
+ * at until the run through them has been allocated, so truncate can't
+ * pull them away underneath us.  Errors are left for the page writes to
+ * run into and report.
+ */
+static void ext2_da_alloc_range(struct address_space *mapping,
+				pgoff_t index, pgoff_t end)
+{
+	struct inode *inode = mapping->host;
+	unsigned bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	struct page *locked[EXT2_DA_BATCH];
+	sector_t run_start = 0;
+	unsigned long run_len = 0;
+	struct pagevec pvec;
+	int nlocked = 0;
+	int err = 0;
+	int i, nr;
+
+	pagevec_init(&pvec, 0);
+	while (!err && index <= end) {
+		nr = pagevec_lookup_tag(&pvec, mapping, &index,
+				PAGECACHE_TAG_DIRTY,
+				min(end - index, (pgoff_t)PAGEVEC_SIZE - 1) + 1);
+		if (!nr)
+			break;
+		for (i = 0; i < nr && !err; i++) {
+			struct page *page = pvec.pages[i];
+			struct buffer_head *head, *bh;
+			sector_t block;
+			int delayed = 0;
+
+			if (page->index > end)
+				break;
+			lock_page(page);
+			if (page->mapping != mapping ||
+			    !page_has_buffers(page) || PageWriteback(page)) {
+				unlock_page(page);
+				continue;
+			}
+			page_cache_get(page);
+			locked[nlocked++] = page;
+
+			block = (sector_t)page->index << bits;
+			bh = head = page_buffers(page);
+			do {
+				if (!buffer_delay(bh)) {
+					if (run_len)
+						err = ext2_da_map_run(inode,
+							locked, nlocked,
+							run_start, run_len);
+					run_len = 0;
+				} else if (run_len &&
+					   block == run_start + run_len) {
+					run_len++;
+					delayed = 1;
+				} else {
+					if (run_len)
+						err = ext2_da_map_run(inode,
+							locked, nlocked,
+							run_start, run_len);
+					run_start = block;
+					run_len = 1;
+					delayed = 1;
+				}
+				block++;
+			} while (!err && (bh = bh->b_this_page) != head);
+
+			if (!delayed && !run_len) {
+				ext2_da_unlock_pages(&locked[--nlocked], 1);
+			} else if (nlocked == EXT2_DA_BATCH) {
+				if (!err && run_len)
+					err = ext2_da_map_run(inode, locked,
+						nlocked, run_start, run_len);
+				run_len = 0;
+				ext2_da_unlock_pages(locked, nlocked);
+				nlocked = 0;
+			}
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+	if (!err && run_len)
+		ext2_da_map_run(inode, locked, nlocked, run_start, run_len);
+	ext2_da_unlock_pages(locked, nlocked);
+}
+
+static int
+ext2_da_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	int ret;
+
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+				ext2_da_get_block_prep);
+	if (ret < 0)
+		ext2_write_failed(mapping, pos + len);
+	return ret;
+}
+
+static int ext2_da_writepage(struct page *page, struct writeback_control *wbc)
+{
+	return block_write_full_page(page, ext2_da_get_block_write, wbc);
+}
+
+static int
+ext2_da_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	pgoff_t start = 0, end = ULONG_MAX;
+
+	if (!wbc->range_cyclic) {
+		start = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+	}
+	ext2_da_alloc_range(mapping, start, end);
+	return generic_writepages(mapping, wbc);
+}
+
+static void ext2_da_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct buffer_head *head, *bh;
+	unsigned long curr = 0, dropped = 0;
+
+	/* The buffers block_invalidatepage() is about to discard */
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (curr >= offset && buffer_delay(bh))
+				dropped++;
+			curr += bh->b_size;
+		} while ((bh = bh->b_this_page) != head);
+	}
+	if (dropped)
+		ext2_da_release(page->mapping->host, dropped);
+	block_invalidatepage(page, offset);
+}
+
+static sector_t ext2_da_bmap(struct address_space *mapping, sector_t block)
+{
+	/* Delayed blocks have no address until they are written */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return generic_block_bmap(mapping, block, ext2_get_block);
+}
+
 const struct address_space_operations ext2_aops = {
 	.readpage		= ext2_readpage,
 	.readpages		= ext2_readpages,
@@ -885,6 +1759,21 @@ const struct address_space_operations ext2_aops = {
 	.error_remove_page	= generic_error_remove_page,
 };
 
+const struct address_space_operations ext2_da_aops = {
+	.readpage		= ext2_readpage,
+	.readpages		= ext2_readpages,
+	.writepage		= ext2_da_writepage,
+	.write_begin		= ext2_da_write_begin,
+	.write_end		= ext2_write_end,
+	.bmap			= ext2_da_bmap,
+	.invalidatepage		= ext2_da_invalidatepage,
+	.direct_IO		= ext2_direct_IO,
+	.writepages		= ext2_da_writepages,
+	.migratepage		= buffer_migrate_page,
+	.is_partially_uptodate	= block_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
 const struct address_space_operations ext2_aops_xip = {
 	.bmap			= ext2_bmap,
 	.get_xip_mem		= ext2_get_xip_mem,
@@ -1164,6 +2053,10 @@ do_indirects:
 
 	ext2_discard_reservation(inode);
 
+	/* ext3301: nothing uninitialized is left past the new end */
+	if (iblock <= ei->i_init_blocks)
+		ei->i_init_blocks = EXT2_INIT_BLOCKS_ALL;
+
 	mutex_unlock(&ei->truncate_mutex);
 }
 
@@ -1187,6 +2080,23 @@ static void ext2_truncate_blocks(struct inode *inode, loff_t offset)
 	__ext2_truncate_blocks(inode, offset);
 }
 
+/*
+ * ext3301: give back the blocks of a directory past @newsize.  The caller
+ * holds i_mutex and has made sure no live entries remain out there.
+ */
+void ext2_shrink_dir(struct inode *dir, loff_t newsize)
+{
+	truncate_setsize(dir, newsize);
+	__ext2_truncate_blocks(dir, newsize);
+
+	if (IS_DIRSYNC(dir)) {
+		sync_mapping_buffers(dir->i_mapping);
+		sync_inode_metadata(dir, 1);
+	} else {
+		mark_inode_dirty(dir);
+	}
+}
+
 static int ext2_setsize(struct inode *inode, loff_t newsize)
 {
 	int error;
@@ -1226,31 +2136,158 @@ static int ext2_setsize(struct inode *inode, loff_t newsize)
 	return 0;
 }
 
+/*
+ * Find the inode table block holding inode @ino, which the caller has
+ * already range-checked.  The byte offset of the inode within that block
+ * is stored in *offset.  Returns 0 if the group descriptor is unavailable.
+ */
+ext2_fsblk_t ext2_inode_loc(struct super_block *sb, ino_t ino,
+			    unsigned long *offset)
+{
+	unsigned long block_group;
+	struct ext2_group_desc * gdp;
+
+	block_group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
+	gdp = ext2_get_group_desc(sb, block_group, NULL);
+	if (!gdp)
+		return 0;
+	/*
+	 * Figure out the offset within the block group inode table
+	 */
+	*offset = ((ino - 1) % EXT2_INODES_PER_GROUP(sb)) * EXT2_INODE_SIZE(sb);
+	return le32_to_cpu(gdp->bg_inode_table) +
+		(*offset >> EXT2_BLOCK_SIZE_BITS(sb));
+}
+
+/*
+ * ext3301: get the inode table block for a freshly allocated inode.  On an
+ * uninit_bg filesystem the table may never have been zeroed, so if no
+ * other inode in the block is in use we build the block in memory rather
+ * than read stale data back from disk.
+ */
+static struct buffer_head *ext2_new_inode_block(struct super_block *sb,
+						ino_t ino, unsigned long block)
+{
+	unsigned long group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
+	unsigned long per_block = EXT2_SB(sb)->s_inodes_per_block;
+	unsigned long first, i;
+	struct ext2_group_desc *gdp;
+	struct buffer_head *bh, *bitmap_bh;
+
+	bh = sb_getblk(sb, block);
+	if (!bh)
+		return NULL;
+	if (bh_uptodate_or_lock(bh))
+		return bh;
+
+	gdp = ext2_get_group_desc(sb, group, NULL);
+	if (gdp && !(ext2_bg_flags(sb, gdp) & EXT2_BG_INODE_ZEROED)) {
+		bitmap_bh = ext2_read_inode_bitmap(sb, group);
+		if (bitmap_bh) {
+			first = ((ino - 1) % EXT2_INODES_PER_GROUP(sb)) &
+				~(per_block - 1);
+			for (i = first; i < first + per_block; i++) {
+				if (i != (ino - 1) % EXT2_INODES_PER_GROUP(sb) &&
+				    ext2_test_bit(i, bitmap_bh->b_data))
+					break;
+			}
+			brelse(bitmap_bh);
+			if (i == first + per_block) {
+				memset(bh->b_data, 0, bh->b_size);
+				set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+				return bh;
+			}
+		}
+	}
+	if (bh_submit_read(bh) < 0) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/*
+ * ext3301: an inode table block is about to be read.  Start reads of the
+ * rest of the aligned inode_readahead_blks window around it as well, since
+ * find_group_other() puts related inodes next to each other.  Blocks past
+ * the last inode ever used in the group are left out, and so are blocks
+ * with no inode in use if the group's inode bitmap happens to be cached.
+ */
+static void ext2_inode_readahead(struct super_block *sb, ino_t ino,
+				 ext2_fsblk_t block)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
+	unsigned long per_block = sbi->s_inodes_per_block;
+	unsigned long ra = sbi->s_inode_readahead_blks;
+	unsigned long first, end, used, i;
+	struct ext2_group_desc *gdp;
+	struct buffer_head *bitmap_bh = NULL;
+	ext2_fsblk_t table;
+	struct blk_plug plug;
+
+	gdp = ext2_get_group_desc(sb, group, NULL);
+	if (!gdp || le16_to_cpu(gdp->bg_free_inodes_count) ==
+						EXT2_INODES_PER_GROUP(sb))
+		return;
+	table = le32_to_cpu(gdp->bg_inode_table);
+	first = (block - table) & ~(ra - 1);
+	end = min(first + ra, sbi->s_itb_per_group);
+	if (ext2_has_group_desc_csum(sb)) {
+		used = EXT2_INODES_PER_GROUP(sb) -
+			le16_to_cpu(gdp->bg_itable_unused);
+		end = min(end, DIV_ROUND_UP(used, per_block));
+	}
+
+	bitmap_bh = sb_find_get_block(sb, le32_to_cpu(gdp->bg_inode_bitmap));
+	if (bitmap_bh && !buffer_uptodate(bitmap_bh)) {
+		brelse(bitmap_bh);
+		bitmap_bh = NULL;
+	}
+
+	blk_start_plug(&plug);
+	for (i = first; i < end; i++) {
+		if (table + i == block)
+			continue;
+		if (bitmap_bh && ext2_find_next_bit(bitmap_bh->b_data,
+				(i + 1) * per_block, i * per_block) >=
+							(i + 1) * per_block)
+			continue;
+		sb_breadahead(sb, table + i);
+	}
+	blk_finish_plug(&plug);
+	brelse(bitmap_bh);
+}
+
 static struct ext2_inode *ext2_get_inode(struct super_block *sb, ino_t ino,
-					struct buffer_head **p)
+					struct buffer_head **p, int new)
 {
 	struct buffer_head * bh;
-	unsigned long block_group;
 	unsigned long block;
 	unsigned long offset;
-	struct ext2_group_desc * gdp;
 
 	*p = NULL;
 	if ((ino != EXT2_ROOT_INO && ino < EXT2_FIRST_INO(sb)) ||
 	    ino > le32_to_cpu(EXT2_SB(sb)->s_es->s_inodes_count))
 		goto Einval;
 
-	block_group = (ino - 1) / EXT2_INODES_PER_GROUP(sb);
-	gdp = ext2_get_group_desc(sb, block_group, NULL);
-	if (!gdp)
+	block = ext2_inode_loc(sb, ino, &offset);
+	if (!block)
 		goto Egdp;
-	/*
-	 * Figure out the offset within the block group inode table
-	 */
-	offset = ((ino - 1) % EXT2_INODES_PER_GROUP(sb)) * EXT2_INODE_SIZE(sb);
-	block = le32_to_cpu(gdp->bg_inode_table) +
-		(offset >> EXT2_BLOCK_SIZE_BITS(sb));
-	if (!(bh = sb_bread(sb, block)))
+	if (new && ext2_has_group_desc_csum(sb)) {
+		bh = ext2_new_inode_block(sb, ino, block);
+	} else {
+		bh = sb_getblk(sb, block);
+		if (bh && !buffer_uptodate(bh) &&
+		    EXT2_SB(sb)->s_inode_readahead_blks > 1)
+			ext2_inode_readahead(sb, ino, block);
+		if (bh && !bh_uptodate_or_lock(bh) && bh_submit_read(bh) < 0) {
+			brelse(bh);
+			bh = NULL;
+		}
+	}
+	if (!bh)
 		goto Eio;
 
 	*p = bh;
@@ -1269,6 +2306,70 @@ Egdp:
 	return ERR_PTR(-EIO);
 }
 
+/*
+ * ext3301: fill in the attribute half of a readdir-plus record.
+ *
+ * An inode that is already in core is reported from memory, since it may
+ * be dirty.  Anything else is decoded straight from the inode table; we
+ * deliberately do not instantiate an in-core inode, so that listing a big
+ * directory does not flood the inode cache.  The caller is expected to
+ * have started reads of the inode table blocks already.
+ */
+int ext2_fill_dirent_plus(struct super_block *sb, struct ext2_dirent_plus *dp)
+{
+	struct user_namespace *ns = current_user_ns();
+	struct inode *inode;
+	struct buffer_head *bh;
+	struct ext2_inode *raw_inode;
+	uid_t i_uid;
+	gid_t i_gid;
+
+	inode = ilookup(sb, dp->dp_ino);
+	if (inode) {
+		dp->dp_mode = inode->i_mode;
+		dp->dp_nlink = inode->i_nlink;
+		dp->dp_uid = from_kuid_munged(ns, inode->i_uid);
+		dp->dp_gid = from_kgid_munged(ns, inode->i_gid);
+		dp->dp_size = i_size_read(inode);
+		dp->dp_blocks = inode->i_blocks;
+		dp->dp_atime = inode->i_atime.tv_sec;
+		dp->dp_mtime = inode->i_mtime.tv_sec;
+		dp->dp_ctime = inode->i_ctime.tv_sec;
+		iput(inode);
+		return 0;
+	}
+
+	raw_inode = ext2_get_inode(sb, dp->dp_ino, &bh, 0);
+	if (IS_ERR(raw_inode))
+		return PTR_ERR(raw_inode);
+
+	/* Same liveness test as ext2_iget(); we may have raced with unlink */
+	if (!raw_inode->i_links_count &&
+	    (!raw_inode->i_mode || raw_inode->i_dtime)) {
+		brelse(bh);
+		return -ENOENT;
+	}
+	dp->dp_mode = le16_to_cpu(raw_inode->i_mode);
+	i_uid = (uid_t)le16_to_cpu(raw_inode->i_uid_low);
+	i_gid = (gid_t)le16_to_cpu(raw_inode->i_gid_low);
+	if (!(test_opt(sb, NO_UID32))) {
+		i_uid |= le16_to_cpu(raw_inode->i_uid_high) << 16;
+		i_gid |= le16_to_cpu(raw_inode->i_gid_high) << 16;
+	}
+	dp->dp_uid = from_kuid_munged(ns, make_kuid(&init_user_ns, i_uid));
+	dp->dp_gid = from_kgid_munged(ns, make_kgid(&init_user_ns, i_gid));
+	dp->dp_nlink = le16_to_cpu(raw_inode->i_links_count);
+	dp->dp_size = le32_to_cpu(raw_inode->i_size);
+	if (S_ISREG(dp->dp_mode))
+		dp->dp_size |= ((__u64)le32_to_cpu(raw_inode->i_size_high)) << 32;
+	dp->dp_blocks = le32_to_cpu(raw_inode->i_blocks);
+	dp->dp_atime = (signed)le32_to_cpu(raw_inode->i_atime);
+	dp->dp_mtime = (signed)le32_to_cpu(raw_inode->i_mtime);
+	dp->dp_ctime = (signed)le32_to_cpu(raw_inode->i_ctime);
+	brelse(bh);
+	return 0;
+}
+
 void ext2_set_inode_flags(struct inode *inode)
 {
 	unsigned int flags = EXT2_I(inode)->i_flags;
@@ -1328,7 +2429,7 @@ struct inode *ext2_iget (struct super_block *sb, unsigned long ino)
 	ei = EXT2_I(inode);
 	ei->i_block_alloc_info = NULL;
 
-	raw_inode = ext2_get_inode(inode->i_sb, ino, &bh);
+	raw_inode = ext2_get_inode(inode->i_sb, ino, &bh, 0);
 	if (IS_ERR(raw_inode)) {
 		ret = PTR_ERR(raw_inode);
  		goto bad_inode;
@@ -1377,6 +2478,22 @@ struct inode *ext2_iget (struct super_block *sb, unsigned long ino)
 	ei->i_state = 0;
 	ei->i_block_group = (ino - 1) / EXT2_INODES_PER_GROUP(inode->i_sb);
 	ei->i_dir_start_lookup = 0;
+	ei->i_dir_entries = 0;
+	ei->i_init_blocks = EXT2_INIT_BLOCKS_ALL;
+	if (S_ISREG(inode->i_mode) &&
+	    EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_INIT_MARK))
+		ei->i_init_blocks = le32_to_cpu(raw_inode->i_init_mark) - 1;
+
+	/*
+	 * ext3301: a count from an older generation may be stale (see
+	 * ext2_dircount_setup()); ext2_dir_count() rebuilds it on first use.
+	 */
+	if (S_ISDIR(inode->i_mode) && raw_inode->i_dir_count &&
+	    le32_to_cpu(raw_inode->i_dir_count_gen) ==
+					EXT2_SB(sb)->s_dircount_gen) {
+		ei->i_dir_entries = le32_to_cpu(raw_inode->i_dir_count) - 1;
+		ei->i_state |= EXT2_STATE_DIRCOUNT;
+	}
 
 	/*
 	 * NOTE! The in-memory inode i_data array is in little-endian order
@@ -1393,6 +2510,9 @@ struct inode *ext2_iget (struct super_block *sb, unsigned long ino)
 		} else if (test_opt(inode->i_sb, NOBH)) {
 			inode->i_mapping->a_ops = &ext2_nobh_aops;
 			inode->i_fop = &ext2_file_operations;
+		} else if (test_opt(inode->i_sb, DELALLOC)) {
+			inode->i_mapping->a_ops = &ext2_da_aops;
+			inode->i_fop = &ext2_file_operations;
 		} else {
 			inode->i_mapping->a_ops = &ext2_aops;
 			inode->i_fop = &ext2_file_operations;
@@ -1435,7 +2555,12 @@ bad_inode:
 	return ERR_PTR(ret);
 }
 
-static int __ext2_write_inode(struct inode *inode, int do_sync)
+/*
+ * ext3301: copy the in-core inode into its inode table block and mark the
+ * block dirty if that changed anything.  The block is returned held, for
+ * the caller to write out.
+ */
+static struct buffer_head *ext2_update_inode(struct inode *inode)
 {
 	struct ext2_inode_info *ei = EXT2_I(inode);
 	struct super_block *sb = inode->i_sb;
@@ -1443,12 +2568,14 @@ static int __ext2_write_inode(struct inode *inode, int do_sync)
 	uid_t uid = i_uid_read(inode);
 	gid_t gid = i_gid_read(inode);
 	struct buffer_head * bh;
-	struct ext2_inode * raw_inode = ext2_get_inode(sb, ino, &bh);
+	struct ext2_inode * raw_inode = ext2_get_inode(sb, ino, &bh,
+					ei->i_state & EXT2_STATE_NEW);
+	struct ext2_inode old;
 	int n;
-	int err = 0;
 
 	if (IS_ERR(raw_inode))
- 		return -EIO;
+		return ERR_PTR(-EIO);
+	old = *raw_inode;
 
 	/* For fields not not tracking in the in-memory inode,
 	 * initialise them to zero for new inodes. */
@@ -1526,16 +2653,95 @@ static int __ext2_write_inode(struct inode *inode, int do_sync)
 		}
 	} else for (n = 0; n < EXT2_N_BLOCKS; n++)
 		raw_inode->i_block[n] = ei->i_data[n];
-	mark_buffer_dirty(bh);
+	if (S_ISDIR(inode->i_mode)) {
+		raw_inode->i_dir_count = (ei->i_state & EXT2_STATE_DIRCOUNT) ?
+			cpu_to_le32(ei->i_dir_entries + 1) : 0;
+		raw_inode->i_dir_count_gen =
+			cpu_to_le32(EXT2_SB(sb)->s_dircount_gen);
+	}
+	if (S_ISREG(inode->i_mode) &&
+	    EXT2_HAS_RO_COMPAT_FEATURE(sb, EXT2_FEATURE_RO_COMPAT_INIT_MARK))
+		raw_inode->i_init_mark = cpu_to_le32(ei->i_init_blocks + 1);
+	/*
+	 * A neighbour's sync may already have written us out, see
+	 * ext2_update_neighbours(); don't write the block again for nothing.
+	 */
+	if ((ei->i_state & EXT2_STATE_NEW) ||
+	    memcmp(&old, raw_inode, sizeof(old)))
+		mark_buffer_dirty(bh);
+	ei->i_state &= ~EXT2_STATE_NEW;
+	ext2_lazytime_clear(inode);
+	return bh;
+}
+
+/*
+ * ext3301: ilookup5_nowait() test for ext2_update_neighbours(), called
+ * under inode->i_lock.  Turning down inodes that are being freed keeps
+ * find_inode() from waiting on them.  Turning down unlinked ones means
+ * our iput() normally just returns a linked inode to the LRU.
+ */
+static int ext2_test_neighbour(struct inode *inode, void *data)
+{
+	if (inode->i_ino != *(ino_t *)data)
+		return 0;
+	if (inode->i_state & (I_NEW | I_FREEING | I_WILL_FREE))
+		return 0;
+	if (!inode->i_nlink)
+		return 0;
+	return (inode->i_state & (I_DIRTY_SYNC | I_DIRTY_DATASYNC)) ||
+		!list_empty(&EXT2_I(inode)->i_lazy_list);
+}
+
+/*
+ * ext3301: @inode is about to be synced.  Copy any other dirty in-core
+ * inodes, lazytime ones included, that share its inode table block into
+ * the block as well, so that one write covers them all.  When their own
+ * turn comes, e.g. as the rest of a sync(2) or a mass chmod,
+ * ext2_update_inode() finds nothing changed and the block stays clean.
+ */
+static void ext2_update_neighbours(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long per_block = EXT2_SB(sb)->s_inodes_per_block;
+	ino_t ino, first = ((inode->i_ino - 1) & ~(per_block - 1)) + 1;
+	struct buffer_head *bh;
+	struct inode *other;
+
+	for (ino = first; ino < first + per_block; ino++) {
+		if (ino == inode->i_ino)
+			continue;
+		other = ilookup5_nowait(sb, ino, ext2_test_neighbour, &ino);
+		if (!other)
+			continue;
+		bh = ext2_update_inode(other);
+		if (!IS_ERR(bh))
+			brelse(bh);
+		iput(other);
+	}
+}
+
+static int __ext2_write_inode(struct inode *inode, int do_sync)
+{
+	struct buffer_head *bh = ext2_update_inode(inode);
+	int err = 0;
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
 	if (do_sync) {
+		ext2_update_neighbours(inode);
 		sync_dirty_buffer(bh);
 		if (buffer_req(bh) && !buffer_uptodate(bh)) {
 			printk ("IO error syncing ext2 inode [%s:%08lx]\n",
-				sb->s_id, (unsigned long) ino);
+				inode->i_sb->s_id, (unsigned long) inode->i_ino);
+			/*
+			 * ext3301: the neighbours' copies are only in this
+			 * buffer now and ext2_update_inode() won't redirty
+			 * it for them, so keep it dirty for another try.
+			 */
+			mark_buffer_dirty(bh);
 			err = -EIO;
 		}
 	}
-	ei->i_state &= ~EXT2_STATE_NEW;
 	brelse (bh);
 	return err;
 }
@@ -1545,6 +2751,218 @@ int ext2_write_inode(struct inode *inode, struct writeback_control *wbc)
 	return __ext2_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
 }
 
+/*
+ * ext3301: DIRSYNC group commit.
+ *
+ * A synchronous directory update used to cost a page write and an inode
+ * block write, each waited for in turn, per operation.  Now each caller
+ * starts the write of its directory page, copies the directory inode into
+ * its buffer and queues itself.  Whoever holds s_dirsync_mutex next writes
+ * every queued inode block, waits for all I/O of the batch and issues a
+ * single cache flush for the lot.  Callers that queue while a batch is in
+ * flight go out together in the next one.  Nobody returns before its own
+ * update is on stable storage.
+ */
+struct ext2_dirsync_req {
+	struct list_head	list;
+	struct page		*page;
+	struct buffer_head	*bh;
+	int			err;
+	int			done;
+};
+
+static void ext2_dirsync_flush(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_dirsync_req *req;
+	LIST_HEAD(batch);
+	int err;
+
+	spin_lock(&sbi->s_dirsync_lock);
+	list_splice_init(&sbi->s_dirsync_list, &batch);
+	spin_unlock(&sbi->s_dirsync_lock);
+
+	/* Directories sharing an inode table block cost one write */
+	list_for_each_entry(req, &batch, list)
+		write_dirty_buffer(req->bh, WRITE_SYNC);
+
+	list_for_each_entry(req, &batch, list) {
+		wait_on_page_writeback(req->page);
+		if (PageError(req->page))
+			req->err = -EIO;
+		wait_on_buffer(req->bh);
+		if (!buffer_uptodate(req->bh))
+			req->err = -EIO;
+	}
+
+	err = blkdev_issue_flush(sb->s_bdev, GFP_NOFS, NULL);
+	if (err == -EOPNOTSUPP)
+		err = 0;
+	list_for_each_entry(req, &batch, list) {
+		if (!req->err)
+			req->err = err;
+		req->done = 1;
+	}
+}
+
+/*
+ * Called with the directory page locked and just modified; unlocks it.
+ * Parent is locked.
+ */
+int ext2_dirsync_commit(struct inode *dir, struct page *page)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+	struct ext2_dirsync_req req;
+	int err;
+
+	/* A write already in flight doesn't carry this change */
+	wait_on_page_writeback(page);
+	err = write_one_page(page, 0);
+	if (err)
+		return err;
+
+	req.page = page;
+	req.bh = ext2_update_inode(dir);
+	if (IS_ERR(req.bh))
+		return PTR_ERR(req.bh);
+	req.err = 0;
+	req.done = 0;
+
+	spin_lock(&sbi->s_dirsync_lock);
+	list_add_tail(&req.list, &sbi->s_dirsync_list);
+	spin_unlock(&sbi->s_dirsync_lock);
+
+	mutex_lock(&sbi->s_dirsync_mutex);
+	if (!req.done)
+		ext2_dirsync_flush(dir->i_sb);
+	mutex_unlock(&sbi->s_dirsync_mutex);
+
+	brelse(req.bh);
+	return req.err;
+}
+
+/*
+ * ext3301: lazytime.
+ *
+ * atime updates and the mtime/ctime updates of overwrites only change
+ * timestamps.  With -o lazytime these no longer dirty the inode; it is
+ * queued on s_lazy_list instead and the timestamps stay in memory until
+ * the inode is written for some other reason, fsync()ed, synced, evicted,
+ * or s_lazytime_age seconds have gone by.  Anything that changes the size
+ * or the blocks still calls mark_inode_dirty() and is written as before.
+ */
+int ext2_update_time(struct inode *inode, struct timespec *time, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	int first;
+
+	if (flags & S_ATIME)
+		inode->i_atime = *time;
+	if (flags & S_VERSION)
+		inode_inc_iversion(inode);
+	if (flags & S_CTIME)
+		inode->i_ctime = *time;
+	if (flags & S_MTIME)
+		inode->i_mtime = *time;
+
+	if (!test_opt(sb, LAZYTIME)) {
+		mark_inode_dirty_sync(inode);
+		return 0;
+	}
+	/*
+	 * Already due to be written, and it will pick the times up.  Dirty
+	 * pages alone don't count: they don't get ->write_inode() called.
+	 */
+	if (inode->i_state & (I_DIRTY_SYNC | I_DIRTY_DATASYNC))
+		return 0;
+
+	spin_lock(&sbi->s_lazy_lock);
+	if (list_empty(&ei->i_lazy_list)) {
+		first = list_empty(&sbi->s_lazy_list);
+		ei->i_lazy_since = jiffies;
+		list_add_tail(&ei->i_lazy_list, &sbi->s_lazy_list);
+		if (first)
+			schedule_delayed_work(&sbi->s_lazy_work,
+					      sbi->s_lazytime_age * HZ);
+	}
+	spin_unlock(&sbi->s_lazy_lock);
+	return 0;
+}
+
+/*
+ * Take @inode off s_lazy_list, because its timestamps are being written
+ * or it is going away.  Returns 1 if it was queued.
+ */
+int ext2_lazytime_clear(struct inode *inode)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+	struct ext2_inode_info *ei = EXT2_I(inode);
+	int queued;
+
+	if (list_empty(&ei->i_lazy_list))
+		return 0;
+	spin_lock(&sbi->s_lazy_lock);
+	queued = !list_empty(&ei->i_lazy_list);
+	list_del_init(&ei->i_lazy_list);
+	spin_unlock(&sbi->s_lazy_lock);
+	return queued;
+}
+
+/*
+ * Dirty the inodes on s_lazy_list, all of them if @all is set, or else
+ * those that have waited s_lazytime_age.  With @all the inodes are also
+ * written, for sync_fs().
+ */
+void ext2_lazytime_flush(struct super_block *sb, int all)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long age = sbi->s_lazytime_age * HZ;
+	struct ext2_inode_info *ei;
+	struct inode *inode;
+	LIST_HEAD(evicting);
+
+	spin_lock(&sbi->s_lazy_lock);
+	while (!list_empty(&sbi->s_lazy_list)) {
+		ei = list_first_entry(&sbi->s_lazy_list,
+				      struct ext2_inode_info, i_lazy_list);
+		if (!all && time_before(jiffies, ei->i_lazy_since + age)) {
+			/* The list is oldest first: come back for this one */
+			schedule_delayed_work(&sbi->s_lazy_work,
+					      ei->i_lazy_since + age - jiffies);
+			break;
+		}
+		inode = igrab(&ei->vfs_inode);
+		if (!inode) {
+			/* Left queued for ext2_evict_inode() to write */
+			list_move_tail(&ei->i_lazy_list, &evicting);
+			continue;
+		}
+		list_del_init(&ei->i_lazy_list);
+		spin_unlock(&sbi->s_lazy_lock);
+
+		mark_inode_dirty_sync(inode);
+		if (all)
+			sync_inode_metadata(inode, 0);
+		iput(inode);
+		spin_lock(&sbi->s_lazy_lock);
+	}
+	list_splice(&evicting, &sbi->s_lazy_list);
+	spin_unlock(&sbi->s_lazy_lock);
+}
+
+void ext2_lazytime_work(struct work_struct *work)
+{
+	struct ext2_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext2_sb_info, s_lazy_work);
+	struct super_block *sb = sbi->s_sb;
+
+	/* Unmounting: sync_fs() has written everything already */
+	if (sb->s_flags & MS_ACTIVE)
+		ext2_lazytime_flush(sb, 0);
+}
+
 int ext2_setattr(struct dentry *dentry, struct iattr *iattr)
 {
 	struct inode *inode = dentry->d_inode;
@@ -13,6 +13,7 @@
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/mount.h>
+#include <linux/blkdev.h>
 #include <asm/current.h>
 #include <asm/uaccess.h>
 
@@ -153,11 +154,121 @@ setversion_out:
 		if (ei->i_block_alloc_info){
 			struct ext2_reserve_window_node *rsv = &ei->i_block_alloc_info->rsv_window_node;
 			rsv->rsv_goal_size = rsv_window_size;
+			ei->i_block_alloc_info->rsv_flags |= EXT2_RSV_FIXED;
 		}
 		mutex_unlock(&ei->truncate_mutex);
 		mnt_drop_write_file(filp);
 		return 0;
 	}
+	case EXT2_IOC_READDIRPLUS:
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		/* Handing out the children's attributes is a stat() of each */
+		ret = inode_permission(inode, MAY_EXEC);
+		if (ret)
+			return ret;
+		return ext2_readdir_plus(filp,
+				(struct ext2_readdirplus __user *)arg);
+	case EXT2_IOC_COMPACTDIR:
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		mutex_lock(&inode->i_mutex);
+		ret = ext2_compact_dir(inode);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+		return ret;
+	case EXT2_IOC_GETBLOOMSTATS: {
+		struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+		struct ext2_bloom_stats bs;
+
+		bs.bs_hits = atomic_long_read(&sbi->s_bloom_hits);
+		bs.bs_false_positives = atomic_long_read(&sbi->s_bloom_false);
+		spin_lock(&sbi->s_bloom_lock);
+		bs.bs_filters = sbi->s_bloom_filters;
+		bs.bs_mem_used = sbi->s_bloom_mem;
+		bs.bs_mem_max = sbi->s_bloom_max;
+		spin_unlock(&sbi->s_bloom_lock);
+		if (copy_to_user((void __user *)arg, &bs, sizeof(bs)))
+			return -EFAULT;
+		return 0;
+	}
+	case EXT2_IOC_GETDIRCOUNT: {
+		__u32 count;
+
+		if (!S_ISDIR(inode->i_mode))
+			return -ENOTDIR;
+		mutex_lock(&inode->i_mutex);
+		ret = ext2_dir_count(inode, &count);
+		mutex_unlock(&inode->i_mutex);
+		if (ret)
+			return ret;
+		return put_user(count, (__u32 __user *)arg);
+	}
+	case EXT2_IOC_GETFRAG: {
+		struct ext2_frag_stats fs;
+
+		if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+			return -EINVAL;
+		mutex_lock(&inode->i_mutex);
+		ret = ext2_get_frag(inode, &fs);
+		mutex_unlock(&inode->i_mutex);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &fs, sizeof(fs)))
+			return -EFAULT;
+		return 0;
+	}
+	case EXT2_IOC_DEFRAG: {
+		struct ext2_frag_stats fs;
+
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		mutex_lock(&inode->i_mutex);
+		ret = ext2_defrag(inode);
+		if (!ret)
+			ret = ext2_get_frag(inode, &fs);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &fs, sizeof(fs)))
+			return -EFAULT;
+		return 0;
+	}
+	case FITRIM: {
+		struct super_block *sb = inode->i_sb;
+		struct request_queue *q = bdev_get_queue(sb->s_bdev);
+		struct fstrim_range range;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!blk_queue_discard(q))
+			return -EOPNOTSUPP;
+		if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+				   sizeof(range)))
+			return -EFAULT;
+		range.minlen = max_t(u64, range.minlen,
+				     q->limits.discard_granularity);
+		ret = ext2_trim_fs(sb, &range);
+		if (ret < 0)
+			return ret;
+		if (copy_to_user((struct fstrim_range __user *)arg, &range,
+				 sizeof(range)))
+			return -EFAULT;
+		return 0;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -180,6 +291,14 @@ long ext2_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case EXT2_IOC32_SETVERSION:
 		cmd = EXT2_IOC_SETVERSION;
 		break;
+	case EXT2_IOC_READDIRPLUS:
+	case EXT2_IOC_COMPACTDIR:
+	case EXT2_IOC_GETBLOOMSTATS:
+	case EXT2_IOC_GETDIRCOUNT:
+	case EXT2_IOC_GETFRAG:
+	case EXT2_IOC_DEFRAG:
+	case FITRIM:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
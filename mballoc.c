@@ -0,0 +1,364 @@
+/*
+ *  linux/fs/ext2/mballoc.c
+ *  Added to ext2 as part of the ext3301 improvements
+ *
+ *  Buddy summaries of the block bitmaps, used by ext2_new_blocks() to
+ *  find room for multi-block allocations without walking bitmaps.
+ */
+
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include "ext2.h"
+
+/*
+ * For each block group we keep EXT2_MB_ORDERS in-memory bitmaps.  Bit i of
+ * the order k map is set when the 2^k blocks of aligned chunk i are all
+ * free; order 0 is simply the inverse of the on-disk bitmap.  The maps are
+ * built lazily from the on-disk bitmap the first time a group is looked
+ * at, and kept in step by ext2_mb_update() whenever bits are set or
+ * cleared on disk.  Under memory pressure the shrinker drops them, to be
+ * built again when next wanted.
+ *
+ * They are only hints.  Allocation itself still claims bits in the real
+ * bitmap with ext2_set_bit_atomic(), so a stale summary can cost a missed
+ * opportunity but never a double allocation.  Everything here is done
+ * under the group's sb_bgl_lock().
+ */
+struct ext2_buddy {
+	unsigned int	bd_blocks;			/* blocks in the group */
+	unsigned int	bd_count[EXT2_MB_ORDERS];	/* set bits per order */
+	unsigned long	*bd_map[EXT2_MB_ORDERS];
+	unsigned long	bd_bits[0];
+};
+
+static unsigned int ext2_mb_group_blocks(struct super_block *sb,
+					 unsigned int group)
+{
+	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
+
+	if (group == EXT2_SB(sb)->s_groups_count - 1)
+		return le32_to_cpu(es->s_blocks_count) -
+			ext2_group_first_block_no(sb, group);
+	return EXT2_BLOCKS_PER_GROUP(sb);
+}
+
+static struct ext2_buddy *ext2_mb_alloc(unsigned int blocks)
+{
+	struct ext2_buddy *bd;
+	size_t words = 0;
+	int k;
+
+	for (k = 0; k < EXT2_MB_ORDERS; k++)
+		words += BITS_TO_LONGS(blocks >> k);
+	bd = kzalloc(sizeof(*bd) + words * sizeof(long), GFP_NOFS);
+	if (!bd)
+		return NULL;
+	bd->bd_blocks = blocks;
+	words = 0;
+	for (k = 0; k < EXT2_MB_ORDERS; k++) {
+		bd->bd_map[k] = bd->bd_bits + words;
+		words += BITS_TO_LONGS(blocks >> k);
+	}
+	return bd;
+}
+
+/*
+ * Recompute the summary for blocks [from, to) of the group from the
+ * on-disk bitmap, order 0 first and then upwards.  Idempotent, so it
+ * doesn't matter which caller got here first.
+ */
+static void ext2_mb_recompute(struct ext2_buddy *bd, char *bitmap,
+			      unsigned int from, unsigned int to)
+{
+	unsigned int i, first, last, nchunks;
+	int k;
+
+	if (to > bd->bd_blocks)
+		to = bd->bd_blocks;
+	if (from >= to)
+		return;
+
+	for (i = from; i < to; i++) {
+		int free = !ext2_test_bit(i, bitmap);
+
+		if (free == !!test_bit(i, bd->bd_map[0]))
+			continue;
+		if (free) {
+			__set_bit(i, bd->bd_map[0]);
+			bd->bd_count[0]++;
+		} else {
+			__clear_bit(i, bd->bd_map[0]);
+			bd->bd_count[0]--;
+		}
+	}
+
+	for (k = 1; k < EXT2_MB_ORDERS; k++) {
+		nchunks = bd->bd_blocks >> k;
+		first = from >> k;
+		last = (to - 1) >> k;
+		for (i = first; i <= last && i < nchunks; i++) {
+			int free = test_bit(2 * i, bd->bd_map[k - 1]) &&
+				   test_bit(2 * i + 1, bd->bd_map[k - 1]);
+
+			if (free == !!test_bit(i, bd->bd_map[k]))
+				continue;
+			if (free) {
+				__set_bit(i, bd->bd_map[k]);
+				bd->bd_count[k]++;
+			} else {
+				__clear_bit(i, bd->bd_map[k]);
+				bd->bd_count[k]--;
+			}
+		}
+	}
+}
+
+/*
+ * Return the summary of @group, building it from the on-disk bitmap if
+ * this is the first time.  Called and returns with the group lock held,
+ * but may drop it to allocate memory or read the bitmap.
+ */
+static struct ext2_buddy *ext2_mb_get(struct super_block *sb,
+				      unsigned int group)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	spinlock_t *lock = sb_bgl_lock(sbi, group);
+	struct buffer_head *bitmap_bh;
+	struct ext2_buddy *bd;
+
+	if (sbi->s_buddy[group])
+		return sbi->s_buddy[group];
+
+	spin_unlock(lock);
+	bd = ext2_mb_alloc(ext2_mb_group_blocks(sb, group));
+	bitmap_bh = bd ? ext2_read_block_bitmap(sb, group) : NULL;
+	spin_lock(lock);
+
+	if (!bitmap_bh) {
+		kfree(bd);
+		return sbi->s_buddy[group];
+	}
+	if (sbi->s_buddy[group]) {
+		kfree(bd);
+	} else {
+		ext2_mb_recompute(bd, bitmap_bh->b_data, 0, bd->bd_blocks);
+		sbi->s_buddy[group] = bd;
+		atomic_inc(&sbi->s_buddy_count);
+	}
+	brelse(bitmap_bh);
+	return sbi->s_buddy[group];
+}
+
+/*
+ * Find a free, aligned run of 2^order blocks in the group, the first one
+ * at or after @goal if there is one, else the first in the group.
+ * Returns the group relative start, or -1.
+ */
+static ext2_grpblk_t ext2_mb_find_run(struct ext2_buddy *bd, int order,
+				      ext2_grpblk_t goal)
+{
+	unsigned int nchunks = bd->bd_blocks >> order;
+	unsigned int i;
+
+	if (!bd->bd_count[order])
+		return -1;
+	i = find_next_bit(bd->bd_map[order], nchunks, goal >> order);
+	if (i >= nchunks)
+		i = find_first_bit(bd->bd_map[order], nchunks);
+	if (i >= nchunks)
+		return -1;
+	return i << order;
+}
+
+/*
+ * Are blocks [start, start + len) of the group all free?
+ */
+static int ext2_mb_range_free(struct ext2_buddy *bd, ext2_grpblk_t start,
+			      unsigned long len)
+{
+	unsigned long end = start + len;
+
+	if (end > bd->bd_blocks)
+		return 0;
+	return find_next_zero_bit(bd->bd_map[0], end, start) >= end;
+}
+
+/**
+ * ext2_mb_find_goal()
+ * @sb:			superblock
+ * @goal:		goal block (filesystem wide)
+ * @count:		number of blocks wanted
+ *
+ * Look for room for @count contiguous blocks, starting at the goal group.
+ * If the goal itself starts a long enough free run it is kept, so that
+ * files keep growing in place.  Otherwise the nearest free aligned chunk
+ * of the next power of two size is returned, or of the largest size we
+ * track for bigger requests; on RAID, it is moved up to the next stripe
+ * boundary if the run is still free from there.  Falls back to @goal
+ * when nothing is known.
+ *
+ * Groups without a summary are passed over once EXT2_MB_BUILD_BUDGET
+ * have been built, so that one call neither reads every bitmap on the
+ * filesystem nor pins a summary for each of them.
+ */
+ext2_fsblk_t ext2_mb_find_goal(struct super_block *sb, ext2_fsblk_t goal,
+			       unsigned long count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct ext2_super_block *es = sbi->s_es;
+	unsigned long ngroups = sbi->s_groups_count;
+	unsigned int group, goal_group;
+	ext2_grpblk_t grp_goal, found = -1;
+	unsigned long i, stripe = ext2_stripe(sb);
+	int order, budget = EXT2_MB_BUILD_BUDGET;
+
+	if (!sbi->s_buddy || count < 2)
+		return goal;
+	if (goal < le32_to_cpu(es->s_first_data_block) ||
+	    goal >= le32_to_cpu(es->s_blocks_count))
+		goal = le32_to_cpu(es->s_first_data_block);
+	goal_group = (goal - le32_to_cpu(es->s_first_data_block)) /
+			EXT2_BLOCKS_PER_GROUP(sb);
+	grp_goal = (goal - le32_to_cpu(es->s_first_data_block)) %
+			EXT2_BLOCKS_PER_GROUP(sb);
+	order = min_t(int, order_base_2(count), EXT2_MB_ORDERS - 1);
+
+	for (i = 0, group = goal_group; i < ngroups; i++, group++) {
+		struct ext2_group_desc *desc;
+		struct ext2_buddy *bd;
+		spinlock_t *lock;
+
+		if (group >= ngroups)
+			group = 0;
+		desc = ext2_get_group_desc(sb, group, NULL);
+		if (!desc || le16_to_cpu(desc->bg_free_blocks_count) <
+							(1U << order))
+			continue;
+
+		lock = sb_bgl_lock(sbi, group);
+		spin_lock(lock);
+		if (!sbi->s_buddy[group]) {
+			if (!budget) {
+				spin_unlock(lock);
+				continue;
+			}
+			budget--;
+		}
+		bd = ext2_mb_get(sb, group);
+		if (bd) {
+			if (group == goal_group &&
+			    ext2_mb_range_free(bd, grp_goal, count)) {
+				spin_unlock(lock);
+				return goal;
+			}
+			found = ext2_mb_find_run(bd, order,
+					group == goal_group ? grp_goal : 0);
+			if (found >= 0 && stripe && count >= stripe) {
+				ext2_fsblk_t first, aligned;
+
+				first = ext2_group_first_block_no(sb, group);
+				aligned = roundup(first + found, stripe);
+				if (ext2_mb_range_free(bd, aligned - first,
+						       count))
+					found = aligned - first;
+			}
+		}
+		spin_unlock(lock);
+		if (found >= 0)
+			return ext2_group_first_block_no(sb, group) + found;
+	}
+	return goal;
+}
+
+/**
+ * ext2_mb_update()
+ * @sb:			superblock
+ * @group:		block group
+ * @bitmap_bh:		the group's block bitmap
+ * @start:		first group relative block that changed
+ * @count:		number of blocks that changed
+ *
+ * Bring the summary of @group back in line with its bitmap after bits in
+ * [start, start + count) were set or cleared.  A group nobody has looked
+ * at yet has no summary to update.
+ */
+void ext2_mb_update(struct super_block *sb, unsigned int group,
+		    struct buffer_head *bitmap_bh, ext2_grpblk_t start,
+		    unsigned long count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	spinlock_t *lock = sb_bgl_lock(sbi, group);
+
+	if (!sbi->s_buddy || !count)
+		return;
+	spin_lock(lock);
+	if (sbi->s_buddy[group])
+		ext2_mb_recompute(sbi->s_buddy[group], bitmap_bh->b_data,
+				  start, start + count);
+	spin_unlock(lock);
+}
+
+/*
+ * Free up to sc->nr_to_scan summaries, going round the groups so that
+ * the ones just rebuilt are the last to go again.  They are only ever
+ * used under the group lock, so nobody can be looking at one we free.
+ */
+static int ext2_mb_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct ext2_sb_info *sbi = container_of(shrink, struct ext2_sb_info,
+						s_mb_shrinker);
+	unsigned long nr = sc->nr_to_scan;
+	unsigned int group, i;
+	struct ext2_buddy *bd;
+	spinlock_t *lock;
+
+	for (i = 0; nr && i < sbi->s_groups_count; i++) {
+		group = sbi->s_mb_shrink_group;
+		if (group >= sbi->s_groups_count)
+			group = 0;
+		sbi->s_mb_shrink_group = group + 1;
+
+		lock = sb_bgl_lock(sbi, group);
+		spin_lock(lock);
+		bd = sbi->s_buddy[group];
+		sbi->s_buddy[group] = NULL;
+		spin_unlock(lock);
+		if (!bd)
+			continue;
+		kfree(bd);
+		atomic_dec(&sbi->s_buddy_count);
+		nr--;
+	}
+	return atomic_read(&sbi->s_buddy_count);
+}
+
+int ext2_mb_init(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	sbi->s_buddy = kcalloc(sbi->s_groups_count, sizeof(*sbi->s_buddy),
+			       GFP_KERNEL);
+	if (!sbi->s_buddy)
+		return -ENOMEM;
+	atomic_set(&sbi->s_buddy_count, 0);
+	sbi->s_mb_shrinker.shrink = ext2_mb_shrink;
+	sbi->s_mb_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_mb_shrinker);
+	return 0;
+}
+
+void ext2_mb_release(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned long i;
+
+	if (!sbi->s_buddy)
+		return;
+	unregister_shrinker(&sbi->s_mb_shrinker);
+	for (i = 0; i < sbi->s_groups_count; i++)
+		kfree(sbi->s_buddy[i]);
+	kfree(sbi->s_buddy);
+	sbi->s_buddy = NULL;
+}
@@ -122,6 +122,9 @@ static int ext2_create (struct inode * dir, struct dentry * dentry, umode_t mode
 	} else if (test_opt(inode->i_sb, NOBH)) {
 		inode->i_mapping->a_ops = &ext2_nobh_aops;
 		inode->i_fop = &ext2_file_operations;
+	} else if (test_opt(inode->i_sb, DELALLOC)) {
+		inode->i_mapping->a_ops = &ext2_da_aops;
+		inode->i_fop = &ext2_file_operations;
 	} else {
 		inode->i_mapping->a_ops = &ext2_aops;
 		inode->i_fop = &ext2_file_operations;
@@ -531,6 +534,7 @@ const struct inode_operations ext2_dir_inode_operations = {
 	.removexattr	= generic_removexattr,
 #endif
 	.setattr	= ext2_setattr,
+	.update_time	= ext2_update_time,
 	.get_acl	= ext2_get_acl,
 };
 
@@ -542,5 +546,6 @@ const struct inode_operations ext2_special_inode_operations = {
 	.removexattr	= generic_removexattr,
 #endif
 	.setattr	= ext2_setattr,
+	.update_time	= ext2_update_time,
 	.get_acl	= ext2_get_acl,
 };
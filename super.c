@@ -35,6 +35,7 @@
 #include <linux/mount.h>
 #include <linux/log2.h>
 #include <linux/quotaops.h>
+#include <linux/kthread.h>
 #include <asm/uaccess.h>
 #include "ext2.h"
 #include "xattr.h"
@@ -128,6 +129,69 @@ void ext2_update_dynamic_rev(struct super_block *sb)
 	 */
 }
 
+/*
+ * ext3301: on an uninit_bg filesystem mke2fs may leave the inode tables
+ * unwritten.  This thread zeroes them in the background, one group at a
+ * time, sleeping s_li_wait_mult times as long as each group took in
+ * between.  Once it is done it just waits to be stopped.
+ */
+static int ext2_lazyinit_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	unsigned int group;
+	unsigned long start;
+
+	for (group = 0; group < sbi->s_groups_count; group++) {
+		if (kthread_should_stop())
+			return 0;
+		start = jiffies;
+		sb_start_write(sb);
+		if (ext2_init_inode_table(sb, group))
+			ext2_msg(sb, KERN_WARNING, "warning: could not zero "
+				 "inode table of group %u", group);
+		sb_end_write(sb);
+		schedule_timeout_interruptible((jiffies - start) *
+					       sbi->s_li_wait_mult);
+	}
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void ext2_lazyinit_start(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	struct task_struct *task;
+
+	if (sbi->s_lazyinit_task || (sb->s_flags & MS_RDONLY) ||
+	    !ext2_has_group_desc_csum(sb) || test_opt(sb, NOINIT_ITABLE))
+		return;
+	task = kthread_run(ext2_lazyinit_thread, sb, "ext2lazyinit/%s",
+			   sb->s_id);
+	if (IS_ERR(task)) {
+		ext2_msg(sb, KERN_WARNING, "warning: could not start "
+			 "lazy inode table initialization");
+		return;
+	}
+	sbi->s_lazyinit_task = task;
+}
+
+static void ext2_lazyinit_stop(struct super_block *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	if (sbi->s_lazyinit_task) {
+		kthread_stop(sbi->s_lazyinit_task);
+		sbi->s_lazyinit_task = NULL;
+	}
+}
+
 static void ext2_put_super (struct super_block * sb)
 {
 	int db_count;
@@ -136,7 +200,11 @@ static void ext2_put_super (struct super_block * sb)
 
 	dquot_disable(sb, -1, DQUOT_USAGE_ENABLED | DQUOT_LIMITS_ENABLED);
 
+	ext2_lazyinit_stop(sb);
+	cancel_delayed_work_sync(&sbi->s_lazy_work);
+	cancel_work_sync(&sbi->s_discard_work);
 	ext2_xattr_put_super(sb);
+	ext2_discard_flush(sb);
 	if (!(sb->s_flags & MS_RDONLY)) {
 		struct ext2_super_block *es = sbi->s_es;
 
@@ -151,9 +219,15 @@ static void ext2_put_super (struct super_block * sb)
 			brelse (sbi->s_group_desc[i]);
 	kfree(sbi->s_group_desc);
 	kfree(sbi->s_debts);
+	kfree(sbi->s_itable_sems);
+	ext2_mb_release(sb);
+	ext2_rsv_release(sb);
+	ext2_bitmap_cache_release(sb);
+	ext2_groups_release(sb);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
 	brelse (sbi->s_sbh);
 	sb->s_fs_info = NULL;
 	kfree(sbi->s_blockgroup_lock);
@@ -169,6 +243,8 @@ static struct inode *ext2_alloc_inode(struct super_block *sb)
 	if (!ei)
 		return NULL;
 	ei->i_block_alloc_info = NULL;
+	ei->i_dir_bloom = NULL;
+	INIT_LIST_HEAD(&ei->i_lazy_list);
 	ei->vfs_inode.i_version = 1;
 	return &ei->vfs_inode;
 }
@@ -299,6 +375,31 @@ static int ext2_show_options(struct seq_file *seq, struct dentry *root)
 
 	if (!test_opt(sb, RESERVATION))
 		seq_puts(seq, ",noreservation");
+	if (sbi->s_bloom_max != EXT2_DEF_BLOOM_MEM * 1024)
+		seq_printf(seq, ",bloom_mem=%lu", sbi->s_bloom_max / 1024);
+	if (test_opt(sb, MBALLOC))
+		seq_puts(seq, ",mballoc");
+	if (test_opt(sb, DELALLOC))
+		seq_puts(seq, ",delalloc");
+	if (test_opt(sb, DISCARD))
+		seq_puts(seq, ",discard");
+	if (sbi->s_stride != le16_to_cpu(es->s_raid_stride))
+		seq_printf(seq, ",stride=%lu", sbi->s_stride);
+	if (sbi->s_stripe_width != le32_to_cpu(es->s_raid_stripe_width))
+		seq_printf(seq, ",stripe_width=%lu", sbi->s_stripe_width);
+	if (sbi->s_bitmap_pin)
+		seq_printf(seq, ",bitmap_pin=%u", sbi->s_bitmap_pin);
+	if (sbi->s_inode_readahead_blks != EXT2_DEF_INODE_READAHEAD_BLKS)
+		seq_printf(seq, ",inode_readahead_blks=%lu",
+			   sbi->s_inode_readahead_blks);
+	if (test_opt(sb, LAZYTIME))
+		seq_puts(seq, ",lazytime");
+	if (sbi->s_lazytime_age != EXT2_DEF_LAZYTIME_AGE)
+		seq_printf(seq, ",lazytime_age=%lu", sbi->s_lazytime_age);
+	if (test_opt(sb, NOINIT_ITABLE))
+		seq_puts(seq, ",noinit_itable");
+	else if (sbi->s_li_wait_mult != EXT2_DEF_LI_WAIT_MULT)
+		seq_printf(seq, ",init_itable=%u", sbi->s_li_wait_mult);
 
 	spin_unlock(&sbi->s_lock);
 	return 0;
@@ -399,7 +500,11 @@ enum {
 	Opt_err_ro, Opt_nouid32, Opt_nocheck, Opt_debug,
 	Opt_oldalloc, Opt_orlov, Opt_nobh, Opt_user_xattr, Opt_nouser_xattr,
 	Opt_acl, Opt_noacl, Opt_xip, Opt_ignore, Opt_err, Opt_quota,
-	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation
+	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation,
+	Opt_bloom_mem, Opt_mballoc, Opt_nomballoc, Opt_delalloc, Opt_nodelalloc,
+	Opt_discard, Opt_nodiscard, Opt_stride, Opt_stripe_width,
+	Opt_bitmap_pin, Opt_init_itable, Opt_noinit_itable,
+	Opt_inode_readahead_blks, Opt_lazytime, Opt_nolazytime, Opt_lazytime_age
 };
 
 static const match_table_t tokens = {
@@ -434,6 +539,23 @@ static const match_table_t tokens = {
 	{Opt_usrquota, "usrquota"},
 	{Opt_reservation, "reservation"},
 	{Opt_noreservation, "noreservation"},
+	{Opt_bloom_mem, "bloom_mem=%u"},
+	{Opt_mballoc, "mballoc"},
+	{Opt_nomballoc, "nomballoc"},
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_stride, "stride=%u"},
+	{Opt_stripe_width, "stripe_width=%u"},
+	{Opt_bitmap_pin, "bitmap_pin=%u"},
+	{Opt_init_itable, "init_itable=%u"},
+	{Opt_init_itable, "init_itable"},
+	{Opt_noinit_itable, "noinit_itable"},
+	{Opt_inode_readahead_blks, "inode_readahead_blks=%u"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_lazytime_age, "lazytime_age=%u"},
 	{Opt_err, NULL}
 };
 
@@ -595,6 +717,80 @@ static int parse_options(char *options, struct super_block *sb)
 			clear_opt(sbi->s_mount_opt, RESERVATION);
 			ext2_msg(sb, KERN_INFO, "reservations OFF");
 			break;
+		case Opt_bloom_mem:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_bloom_max = (unsigned long)option * 1024;
+			break;
+		case Opt_mballoc:
+			set_opt(sbi->s_mount_opt, MBALLOC);
+			break;
+		case Opt_nomballoc:
+			clear_opt(sbi->s_mount_opt, MBALLOC);
+			break;
+		case Opt_delalloc:
+			set_opt(sbi->s_mount_opt, DELALLOC);
+			break;
+		case Opt_nodelalloc:
+			clear_opt(sbi->s_mount_opt, DELALLOC);
+			break;
+		case Opt_discard:
+			set_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		case Opt_stride:
+			/* s_raid_stride is only 16 bits on disk */
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > 0xffff)
+				return 0;
+			sbi->s_stride = option;
+			break;
+		case Opt_stripe_width:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_stripe_width = option;
+			break;
+		case Opt_bitmap_pin:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_bitmap_pin = option;
+			break;
+		case Opt_init_itable:
+			if (args[0].from) {
+				if (match_int(&args[0], &option) || option < 0)
+					return 0;
+				sbi->s_li_wait_mult = option;
+			}
+			clear_opt(sbi->s_mount_opt, NOINIT_ITABLE);
+			break;
+		case Opt_noinit_itable:
+			set_opt(sbi->s_mount_opt, NOINIT_ITABLE);
+			break;
+		case Opt_inode_readahead_blks:
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > (1 << 30) ||
+			    (option && !is_power_of_2(option))) {
+				ext2_msg(sb, KERN_ERR, "Invalid "
+					 "inode_readahead_blks %d, must be 0 "
+					 "or a power of 2 up to 2^30", option);
+				return 0;
+			}
+			sbi->s_inode_readahead_blks = option;
+			break;
+		case Opt_lazytime:
+			set_opt(sbi->s_mount_opt, LAZYTIME);
+			break;
+		case Opt_nolazytime:
+			clear_opt(sbi->s_mount_opt, LAZYTIME);
+			break;
+		case Opt_lazytime_age:
+			if (match_int(&args[0], &option) || option <= 0 ||
+			    option > INT_MAX / HZ)
+				return 0;
+			sbi->s_lazytime_age = option;
+			break;
 		case Opt_ignore:
 			break;
 		default:
@@ -604,6 +800,44 @@ static int parse_options(char *options, struct super_block *sb)
 	return 1;
 }
 
+/*
+ * ext3301: the directory entry counts of ext2_dir_count() are stamped with
+ * s_dircount_gen when written, and only trusted while that is current.
+ * They stay right as long as every read-write mount since they were
+ * written was ours and ended cleanly.  Each read-write mount bumps
+ * s_mnt_count, so we note the value ours left behind.  If we find the
+ * filesystem unclean, or the count moved on (another driver mounted it,
+ * or e2fsck checked it), start a new generation: every stored count is
+ * then stale and gets rebuilt by a scan when next needed.
+ */
+static void ext2_dircount_setup(struct super_block *sb,
+				struct ext2_super_block *es, int read_only)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+	u32 gen = le32_to_cpu(es->s_dircount_gen);
+
+	if (!(sbi->s_mount_state & EXT2_VALID_FS) || !es->s_dircount_mnt ||
+	    es->s_dircount_mnt != es->s_mnt_count)
+		gen++;
+	sbi->s_dircount_gen = gen;
+	if (!read_only)
+		es->s_dircount_gen = cpu_to_le32(gen);
+}
+
+/*
+ * ext3301: stride= and stripe_width= are kept in the superblock, where
+ * mke2fs -E puts them, so they hold for later mounts too.  The caller
+ * writes the superblock out.
+ */
+static void ext2_raid_store(struct super_block *sb,
+			    struct ext2_super_block *es)
+{
+	struct ext2_sb_info *sbi = EXT2_SB(sb);
+
+	es->s_raid_stride = cpu_to_le16(sbi->s_stride);
+	es->s_raid_stripe_width = cpu_to_le32(sbi->s_stripe_width);
+}
+
 static int ext2_setup_super (struct super_block * sb,
 			      struct ext2_super_block * es,
 			      int read_only)
@@ -617,6 +851,7 @@ static int ext2_setup_super (struct super_block * sb,
 			"forcing read-only mode");
 		res = MS_RDONLY;
 	}
+	ext2_dircount_setup(sb, es, read_only);
 	if (read_only)
 		return res;
 	if (!(sbi->s_mount_state & EXT2_VALID_FS))
@@ -642,6 +877,8 @@ static int ext2_setup_super (struct super_block * sb,
 	if (!le16_to_cpu(es->s_max_mnt_count))
 		es->s_max_mnt_count = cpu_to_le16(EXT2_DFL_MAX_MNT_COUNT);
 	le16_add_cpu(&es->s_mnt_count, 1);
+	es->s_dircount_mnt = es->s_mnt_count;
+	ext2_raid_store(sb, es);
 	if (test_opt (sb, DEBUG))
 		ext2_msg(sb, KERN_INFO, "%s, %s, bs=%lu, fs=%lu, gc=%lu, "
 			"bpg=%lu, ipg=%lu, mo=%04lx]",
@@ -671,6 +908,14 @@ static int ext2_check_descriptors(struct super_block *sb)
 		else
 			last_block = first_block +
 				(EXT2_BLOCKS_PER_GROUP(sb) - 1);
+		/*
+		 * ext3301: with FLEX_BG a group's metadata can be anywhere,
+		 * as long as it is on the filesystem.
+		 */
+		if (EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_FLEX_BG)) {
+			first_block = le32_to_cpu(sbi->s_es->s_first_data_block);
+			last_block = le32_to_cpu(sbi->s_es->s_blocks_count) - 1;
+		}
 
 		if (le32_to_cpu(gdp->bg_block_bitmap) < first_block ||
 		    le32_to_cpu(gdp->bg_block_bitmap) > last_block)
@@ -700,6 +945,15 @@ static int ext2_check_descriptors(struct super_block *sb)
 				    i, (unsigned long) le32_to_cpu(gdp->bg_inode_table));
 			return 0;
 		}
+		if (ext2_has_group_desc_csum(sb) &&
+		    gdp->bg_checksum != ext2_group_desc_csum(sb, i, gdp)) {
+			ext2_error (sb, "ext2_check_descriptors",
+				    "Checksum for group %d invalid (%u!=%u)", i,
+				    le16_to_cpu(ext2_group_desc_csum(sb, i, gdp)),
+				    le16_to_cpu(gdp->bg_checksum));
+			if (!(sb->s_flags & MS_RDONLY))
+				return 0;
+		}
 	}
 	return 1;
 }
@@ -872,10 +1126,34 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_resgid = make_kgid(&init_user_ns, le16_to_cpu(es->s_def_resgid));
 	
 	set_opt(sbi->s_mount_opt, RESERVATION);
+	spin_lock_init(&sbi->s_bloom_lock);
+	sbi->s_bloom_max = EXT2_DEF_BLOOM_MEM * 1024;
+	spin_lock_init(&sbi->s_dirsync_lock);
+	INIT_LIST_HEAD(&sbi->s_dirsync_list);
+	mutex_init(&sbi->s_dirsync_mutex);
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	INIT_WORK(&sbi->s_discard_work, ext2_discard_work);
+	sbi->s_stride = le16_to_cpu(es->s_raid_stride);
+	sbi->s_stripe_width = le32_to_cpu(es->s_raid_stripe_width);
+	sbi->s_li_wait_mult = EXT2_DEF_LI_WAIT_MULT;
+	sbi->s_inode_readahead_blks = EXT2_DEF_INODE_READAHEAD_BLKS;
+	spin_lock_init(&sbi->s_lazy_lock);
+	INIT_LIST_HEAD(&sbi->s_lazy_list);
+	INIT_DELAYED_WORK(&sbi->s_lazy_work, ext2_lazytime_work);
+	sbi->s_sb = sb;
+	sbi->s_lazytime_age = EXT2_DEF_LAZYTIME_AGE;
 
 	if (!parse_options((char *) data, sb))
 		goto failed_mount;
 
+	if (test_opt(sb, DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		ext2_msg(sb, KERN_WARNING,
+			"discard not supported by device, disabling");
+		clear_opt(sbi->s_mount_opt, DISCARD);
+	}
+
 	sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
 		((EXT2_SB(sb)->s_mount_opt & EXT2_MOUNT_POSIX_ACL) ?
 		 MS_POSIXACL : 0);
@@ -1025,6 +1303,15 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 			sbi->s_inodes_per_group);
 		goto failed_mount;
 	}
+	if (EXT2_HAS_INCOMPAT_FEATURE(sb, EXT2_FEATURE_INCOMPAT_FLEX_BG)) {
+		sbi->s_log_groups_per_flex = es->s_log_groups_per_flex;
+		if (sbi->s_log_groups_per_flex > 31) {
+			ext2_msg(sb, KERN_ERR,
+				"error: invalid log groups per flex: %u",
+				sbi->s_log_groups_per_flex);
+			goto failed_mount;
+		}
+	}
 
 	if (EXT2_BLOCKS_PER_GROUP(sb) == 0)
 		goto cantfind_ext2;
@@ -1044,6 +1331,18 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 		ext2_msg(sb, KERN_ERR, "error: not enough memory");
 		goto failed_mount_group_desc;
 	}
+	sbi->s_itable_sems = kcalloc(sbi->s_groups_count,
+				     sizeof(*sbi->s_itable_sems), GFP_KERNEL);
+	if (!sbi->s_itable_sems) {
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount_group_desc;
+	}
+	for (i = 0; i < sbi->s_groups_count; i++)
+		init_rwsem(&sbi->s_itable_sems[i]);
+	if (ext2_mb_init(sb)) {
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount_group_desc;
+	}
 	for (i = 0; i < db_count; i++) {
 		block = descriptor_loc(sb, logic_sb_block, i);
 		sbi->s_group_desc[i] = sb_bread(sb, block);
@@ -1063,20 +1362,19 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
 
-	/* per fileystem reservation list head & lock */
-	spin_lock_init(&sbi->s_rsv_window_lock);
-	sbi->s_rsv_window_root = RB_ROOT;
-	/*
-	 * Add a single, static dummy reservation to the start of the
-	 * reservation window list --- it gives us a placeholder for
-	 * append-at-start-of-list which makes the allocation logic
-	 * _much_ simpler.
-	 */
-	sbi->s_rsv_window_head.rsv_start = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
-	sbi->s_rsv_window_head.rsv_end = EXT2_RESERVE_WINDOW_NOT_ALLOCATED;
-	sbi->s_rsv_window_head.rsv_alloc_hit = 0;
-	sbi->s_rsv_window_head.rsv_goal_size = 0;
-	ext2_rsv_window_add(sb, &sbi->s_rsv_window_head);
+	/* reservation window trees, heads & locks */
+	if (ext2_rsv_init(sb)) {
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
+	if (ext2_bitmap_cache_init(sb)) {
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
+	if (ext2_groups_init(sb)) {
+		ext2_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
 
 	err = percpu_counter_init(&sbi->s_freeblocks_counter,
 				ext2_count_free_blocks(sb));
@@ -1088,6 +1386,8 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 		err = percpu_counter_init(&sbi->s_dirs_counter,
 				ext2_count_dirs(sb));
 	}
+	if (!err)
+		err = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0);
 	if (err) {
 		ext2_msg(sb, KERN_ERR, "error: insufficient memory");
 		goto failed_mount3;
@@ -1104,6 +1404,8 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_qcop = &dquot_quotactl_ops;
 #endif
 
+	/* ext3301: for the root; ext2_setup_super() makes it stick */
+	ext2_dircount_setup(sb, es, 1);
 	root = ext2_iget(sb, EXT2_ROOT_INO);
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
@@ -1127,6 +1429,7 @@ static int ext2_fill_super(struct super_block *sb, void *data, int silent)
 	if (ext2_setup_super (sb, es, sb->s_flags & MS_RDONLY))
 		sb->s_flags |= MS_RDONLY;
 	ext2_write_super(sb);
+	ext2_lazyinit_start(sb);
 	return 0;
 
 cantfind_ext2:
@@ -1139,12 +1442,18 @@ failed_mount3:
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
 failed_mount2:
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
 failed_mount_group_desc:
 	kfree(sbi->s_group_desc);
 	kfree(sbi->s_debts);
+	kfree(sbi->s_itable_sems);
+	ext2_mb_release(sb);
+	ext2_rsv_release(sb);
+	ext2_bitmap_cache_release(sb);
+	ext2_groups_release(sb);
 failed_mount:
 	brelse(bh);
 failed_sbi:
@@ -1200,7 +1509,7 @@ static void ext2_sync_super(struct super_block *sb, struct ext2_super_block *es,
  * may have been checked while mounted and e2fsck may have
  * set s_state to EXT2_VALID_FS after some corrections.
  */
-static int ext2_sync_fs(struct super_block *sb, int wait)
+static int __ext2_sync_fs(struct super_block *sb, int wait)
 {
 	struct ext2_sb_info *sbi = EXT2_SB(sb);
 	struct ext2_super_block *es = EXT2_SB(sb)->s_es;
@@ -1221,6 +1530,15 @@ static int ext2_sync_fs(struct super_block *sb, int wait)
 	return 0;
 }
 
+static int ext2_sync_fs(struct super_block *sb, int wait)
+{
+	/* ext3301: trim what -o discard has queued up so far */
+	ext2_discard_flush(sb);
+	/* ext3301: and write the timestamps -o lazytime held back */
+	ext2_lazytime_flush(sb, 1);
+	return __ext2_sync_fs(sb, wait);
+}
+
 static int ext2_freeze(struct super_block *sb)
 {
 	struct ext2_sb_info *sbi = EXT2_SB(sb);
@@ -1251,10 +1569,15 @@ static int ext2_unfreeze(struct super_block *sb)
 	return 0;
 }
 
+/*
+ * ext3301: only the superblock.  This is called from inside inode writes
+ * (ext2_update_inode() setting LARGE_FILE), where syncing other inodes,
+ * as ext2_sync_fs() does for lazytime, could wait on the caller itself.
+ */
 void ext2_write_super(struct super_block *sb)
 {
 	if (!(sb->s_flags & MS_RDONLY))
-		ext2_sync_fs(sb, 1);
+		__ext2_sync_fs(sb, 1);
 }
 
 static int ext2_remount (struct super_block * sb, int * flags, char * data)
@@ -1264,6 +1587,7 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 	unsigned long old_mount_opt = sbi->s_mount_opt;
 	struct ext2_mount_options old_opts;
 	unsigned long old_sb_flags;
+	unsigned int old_bitmap_pin = sbi->s_bitmap_pin;
 	int err;
 
 	spin_lock(&sbi->s_lock);
@@ -1302,14 +1626,26 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 		sbi->s_mount_opt &= ~EXT2_MOUNT_XIP;
 		sbi->s_mount_opt |= old_mount_opt & EXT2_MOUNT_XIP;
 	}
+	if (sbi->s_bitmap_pin != old_bitmap_pin) {
+		ext2_msg(sb, KERN_WARNING, "warning: bitmap_pin can't be "
+			 "changed while remounting");
+		sbi->s_bitmap_pin = old_bitmap_pin;
+	}
 	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY)) {
+		if (!(sb->s_flags & MS_RDONLY))
+			ext2_raid_store(sb, es);
 		spin_unlock(&sbi->s_lock);
+		if (test_opt(sb, NOINIT_ITABLE))
+			ext2_lazyinit_stop(sb);
+		else
+			ext2_lazyinit_start(sb);
 		return 0;
 	}
 	if (*flags & MS_RDONLY) {
 		if (le16_to_cpu(es->s_state) & EXT2_VALID_FS ||
 		    !(sbi->s_mount_state & EXT2_VALID_FS)) {
 			spin_unlock(&sbi->s_lock);
+			ext2_lazyinit_stop(sb);
 			return 0;
 		}
 
@@ -1320,6 +1656,9 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 		es->s_state = cpu_to_le16(sbi->s_mount_state);
 		es->s_mtime = cpu_to_le32(get_seconds());
 		spin_unlock(&sbi->s_lock);
+		ext2_lazyinit_stop(sb);
+		/* sync_fs() has trimmed the queue, don't touch bitmaps now */
+		cancel_work_sync(&sbi->s_discard_work);
 
 		err = dquot_suspend(sb, -1);
 		if (err < 0) {
@@ -1352,6 +1691,7 @@ static int ext2_remount (struct super_block * sb, int * flags, char * data)
 		ext2_write_super(sb);
 
 		dquot_resume(sb, -1);
+		ext2_lazyinit_start(sb);
 	}
 
 	return 0;
@@ -1416,6 +1756,9 @@ static int ext2_statfs (struct dentry * dentry, struct kstatfs * buf)
 	buf->f_blocks = le32_to_cpu(es->s_blocks_count) - sbi->s_overhead_last;
 	buf->f_bfree = ext2_count_free_blocks(sb);
 	es->s_free_blocks_count = cpu_to_le32(buf->f_bfree);
+	/* ext3301: space promised to delayed allocation is as good as used */
+	buf->f_bfree -= min_t(s64, buf->f_bfree,
+		percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter));
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(es->s_r_blocks_count))
 		buf->f_bavail = 0;